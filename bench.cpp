@@ -0,0 +1,65 @@
+#include "bench.h"
+
+#include <cstdio>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+
+volatile uint64_t benchSink=0;
+
+static int64_t nowNs(){
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(
+        steady_clock::now().time_since_epoch()).count();
+}
+
+void printBenchHeader(){
+    printf("%-32s %12s %12s %12s %14s\n",
+        "Benchmark","ns/op med","min","max","nodes/s");
+}
+
+BenchResult runBenchmark(const char *name, BenchFunc fn,
+    int repeats, int warmupMs, int minRunMs){
+    uint64_t nodes=0;
+
+    // Warmup, which also tells how many passes fill a run
+    int64_t start=nowNs();
+    int warmupPasses=0;
+    do{
+        fn(&nodes);
+        warmupPasses++;
+    }while (nowNs()-start<(int64_t)warmupMs*1000000);
+    int64_t passNs=(nowNs()-start)/warmupPasses;
+    int passes=1;
+    if (passNs>0 && passNs<(int64_t)minRunMs*1000000){
+        passes=(int)((int64_t)minRunMs*1000000/passNs)+1;
+    }
+
+    std::vector<double> nsPerOp;
+    uint64_t totalNodes=0;
+    int64_t totalNs=0;
+    for (int r=0;r<repeats;r++){
+        uint64_t ops=0;
+        nodes=0;
+        int64_t t0=nowNs();
+        for (int p=0;p<passes;p++) ops+=fn(&nodes);
+        int64_t elapsed=nowNs()-t0;
+        totalNs+=elapsed;
+        totalNodes+=nodes;
+        nsPerOp.push_back(ops>0?(double)elapsed/ops:0);
+    }
+    std::sort(nsPerOp.begin(),nsPerOp.end());
+
+    BenchResult res;
+    res.nsPerOpMedian=nsPerOp[nsPerOp.size()/2];
+    res.nsPerOpMin=nsPerOp.front();
+    res.nsPerOpMax=nsPerOp.back();
+    res.nodesPerSec=(totalNs>0)?totalNodes*1e9/totalNs:0;
+
+    printf("%-32s %12.1f %12.1f %12.1f",
+        name,res.nsPerOpMedian,res.nsPerOpMin,res.nsPerOpMax);
+    if (totalNodes>0) printf(" %14.0f",res.nodesPerSec);
+    printf("\n");
+    fflush(stdout);
+    return res;
+}
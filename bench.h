@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+
+// Benchmarks write their results here so the work can't be optimized out
+extern volatile uint64_t benchSink;
+
+// One pass of a benchmark. Returns the number of operations done, and
+// adds the search nodes visited (if it counts any) to *nodes.
+typedef std::function<uint64_t(uint64_t *nodes)> BenchFunc;
+
+struct BenchResult{
+    double nsPerOpMedian;
+    double nsPerOpMin;
+    double nsPerOpMax;
+    // 0 if the benchmark counts no nodes
+    double nodesPerSec;
+};
+typedef struct BenchResult BenchResult;
+
+void printBenchHeader();
+// Runs passes for warmupMs, then times `repeats` runs of whole passes,
+// each at least minRunMs long, and prints one line of statistics.
+BenchResult runBenchmark(const char *name, BenchFunc fn,
+    int repeats=10, int warmupMs=200, int minRunMs=100);
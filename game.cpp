@@ -1,157 +1,246 @@
 #include "game.h"
 #include "piece.h"
-int Board::coord2idx(int x, int y){
-    return x+y*BOARD_SIZE;
-}
-Vec2u8 Board::idx2coord(int idx){
-    Vec2u8 res;
-    res.x=idx%BOARD_SIZE;
-    res.y=idx/BOARD_SIZE;
+
+#include <cassert>
+
+// Rows [0..8], columns [9..17], 3x3 squares [18..26]
+struct LineMaskSet{
+    Board masks[27];
+};
+static constexpr LineMaskSet makeLineMasks(){
+    LineMaskSet res;
+    boardbits_t m[27]={};
+    for (int x=0;x<BOARD_SIZE;x++){
+        for (int y=0;y<BOARD_SIZE;y++){
+            int sq=3*(y/3)+(x/3);
+            m[y] |= cellMask(x,y);
+            m[x+9] |= cellMask(x,y);
+            m[sq+18] |= cellMask(x,y);
+        }
+    }
+    for (int i=0;i<27;i++) res.masks[i]=Board(m[i]);
     return res;
 }
-Board::Board(){
-    bitfield[0]=0;
-    bitfield[1]=0;
-    bitfield[2]=0;
-}
-bool Board::read(int x, int y){
-    int idx=coord2idx(x,y);
-    int varnum=idx/32;
-    int bitnum=idx%32;
-    return ((bitfield[varnum])>>bitnum) & 1;
-}
-void Board::write(int x, int y,bool value){
-    int idx=coord2idx(x,y);
-    int varnum=idx/32;
-    int bitnum=idx%32;
-    if (value) bitfield[varnum] |= (1<<bitnum);
-    else bitfield[varnum] &= ~(1<<bitnum);
-}
-bool Board::isEmpty(){
-    return (bitfield[0] | bitfield[1] |  bitfield[2])==0;
-}
-Vec2u8 Board::getFirstFilledCell(){
-    int idx=0;
-    uint32_t bitselect=1;
-    for(int i=0;i<3;i++){
-        if (bitfield[i] !=0){ //there's a bit here
-            while (1){
-                if ((bitfield[i])&bitselect){
-                    return idx2coord(idx);
+static constexpr LineMaskSet lineMasks=makeLineMasks();
+
+Board floodFillBoard(Board b, Board seed){
+    Board fill=seed & b;
+    while (1){
+        // Grow the whole frontier by one step
+        Board next=fill.dilate() & b;
+        if (next==fill) return fill;
+        fill=next;
+    }
+}
+Board floodFillBoard(Board b, Vec2u8 start){
+    Board seed;
+    seed.write(start.x,start.y,true);
+    return floodFillBoard(b,seed);
+}
+int labelIslands(Board b, int *sizes){
+    int n=0;
+    while (!b.isEmpty()){
+        Board island=floodFillBoard(b,b.lowestCell());
+        sizes[n++]=island.countCells();
+        b=b & ~island;
+    }
+    return n;
+}
+
+static PlacementMaskTable *placementTables=nullptr;
+static int numPlacementTables=0;
+// Open-addressed hash of raw piece bits to placementTables index+1,
+// 0 for empty slots. Kept under half full.
+#define PIECE_INDEX_SLOTS 256
+static uint16_t pieceIndex[PIECE_INDEX_SLOTS];
+
+static uint32_t pieceSlot(Piece p){
+    return (p.getRaw()*0x9E3779B1u)>>24;
+}
+
+static int scoreForLines(int count, int numBlocks){
+    int bonus=0;
+    if (count>1) bonus=10*(count-1);
+    return count*18+bonus+numBlocks;
+}
+
+int countFullLines(Board b){
+    int count=0;
+    for (int i=0;i<27;i++){
+        Board line=lineMasks.masks[i];
+        if ((b & line)==line) count++;
+    }
+    return count;
+}
+
+void buildPlacementMaskTable(Piece p, PlacementMaskTable *pmt){
+    pmt->piece=p;
+    pmt->numBlocks=p.numBlocks();
+    pmt->bbox=p.calculateBoundingBox();
+    pmt->maxScoreDelta=0;
+    for (int i=0;i<pmt->numBlocks;i++){
+        Vec2u8 block=p.getBlock(i);
+        pmt->blockOffsets[i]=block.x+block.y*BOARD_SIZE;
+    }
+    pmt->anchors=Board();
+    for (int x=0;x<BOARD_SIZE;x++){
+        for (int y=0;y<BOARD_SIZE;y++){
+            Board mask;
+            if (x<(BOARD_SIZE-pmt->bbox.x) && y<(BOARD_SIZE-pmt->bbox.y)){
+                pmt->anchors.write(x,y,true);
+                for (int i=0;i<pmt->numBlocks;i++){
+                    Vec2u8 block=p.getBlock(i);
+                    mask.write(block.x+x,block.y+y,true);
                 }
-                bitselect<<=1;
-                idx++;
             }
+            pmt->masks[x][y]=mask;
+
+            int touched=0;
+            uint32_t touchedLines=0;
+            for (int i=0;i<27;i++){
+                if (!(mask & lineMasks.masks[i]).isEmpty()){
+                    touched++;
+                    touchedLines|=1u<<i;
+                }
+            }
+            pmt->touchedLines[x][y]=touchedLines;
+            int maxScore=scoreForLines(touched,pmt->numBlocks);
+            if (maxScore>pmt->maxScoreDelta) pmt->maxScoreDelta=maxScore;
         }
-        idx+=32;
     }
-    return Vec2u8();
 }
-Board Board::bitwiseAND(Board other){
-    Board res;
-    for (int i=0;i<3;i++){
-        res.bitfield[i]=bitfield[i] & other.bitfield[i];
+void initPlacementTables(PieceGenerator *pg){
+    int n=pg->getPoolSize();
+    placementTables=new PlacementMaskTable[n];
+    assert(n<PIECE_INDEX_SLOTS/2);
+    for (int i=0;i<n;i++){
+        buildPlacementMaskTable(pg->getPoolPiece(i),&placementTables[i]);
+        if (findPlacementMaskTable(placementTables[i].piece)!=nullptr) continue;
+        uint32_t s=pieceSlot(placementTables[i].piece);
+        while (pieceIndex[s]!=0) s=(s+1)%PIECE_INDEX_SLOTS;
+        pieceIndex[s]=i+1;
     }
-    return res;
+    numPlacementTables=n;
 }
-Board Board::bitwiseOR(Board other){
-    Board res;
-    for (int i=0;i<3;i++){
-        res.bitfield[i]=bitfield[i] | other.bitfield[i];
+PlacementMaskTable* findPlacementMaskTable(Piece p){
+    for (uint32_t s=pieceSlot(p);pieceIndex[s]!=0;s=(s+1)%PIECE_INDEX_SLOTS){
+        PlacementMaskTable *pmt=&placementTables[pieceIndex[s]-1];
+        if (pmt->piece.equal(p)) return pmt;
     }
-    return res;
+    return nullptr;
 }
-Board Board::bitwiseNOT(){
-    Board res;
-    for (int i=0;i<3;i++){
-        res.bitfield[i]= ~bitfield[i];
-    }
-    return res;
-}
-int Board::countCells(){
+
+int getPoolMaxScoreDelta(){
     int res=0;
-    for (int i=0;i<3;i++){
-        for (int b=0;b<32;b++){
-            if (bitfield[i] & (1<<b)) res++;
-        }
+    for (int i=0;i<numPlacementTables;i++){
+        if (placementTables[i].maxScoreDelta>res) res=placementTables[i].maxScoreDelta;
     }
     return res;
 }
-bool Board::equal(Board other){
-    for (int i=0;i<3;i++){
-        if (bitfield[i] != other.bitfield[i] ) return false;
-    }
-    return true;
+
+PlacementMaskTable* getPlacementMaskTable(Piece p, PlacementMaskTable *scratch){
+    PlacementMaskTable *pmt=findPlacementMaskTable(p);
+    if (pmt!=nullptr) return pmt;
+    buildPlacementMaskTable(p,scratch);
+    return scratch;
 }
 
-PlacementResult doPlacement(Board b,Placement pl){
+PlacementResult doPlacementMasked(Board b, Board mask, int numBlocks){
     PlacementResult pr;
 
-    int n=pl.piece.numBlocks();
-    bool success=true;
-    for(int i=0;i<n;i++){
-        Vec2u8 block=pl.piece.getBlock(i);
-        int blockX=block.x;
-        int blockY=block.y;
-        int absX=blockX+pl.x;
-        int absY=blockY+pl.y;
-
-        if (absX<0 || absX>=BOARD_SIZE) success=false;
-        else if (absY<0 || absY>=BOARD_SIZE) success=false;
-        else if (b.read(absX,absY) !=0) success=false;
+    // early abort for fails
+    pr.success=(b & mask).isEmpty();
+    if (!pr.success){
+        pr.scoreDelta=0;
+        return pr;
+    }
 
-        if (!success) break;
+    b=b | mask;
+    pr.preClear=b;
 
-        b.write(absX,absY,true);
+    //check lines
+    int count=0;
+    Board cleared;
+    for (int i=0;i<27;i++){
+        Board line=lineMasks.masks[i];
+        if ((b & line)==line){
+            count++;
+            cleared=cleared | line;
+        }
     }
 
-    // early abort for fails
-    pr.success=success;
-    if (!success) return pr;
+    int score=scoreForLines(count,numBlocks);
 
-    pr.preClear=b;
+    pr.finalResult=b & ~cleared;
+    pr.scoreDelta=score;
 
+    return pr;
+}
 
-    //check lines
-    // checks [0..8] X   [9..17] Y   [18..26] Sq
-    // bit is unset if there is an empty cell
-    uint32_t checks=0xFFFFFFFF;
-    for (int x=0;x<BOARD_SIZE;x++){
-        for (int y=0;y<BOARD_SIZE;y++){
-            bool cell=b.read(x,y);
-            int sq=3*(y/3)+(x/3);
+PlacementResult doPlacementAt(Board b, PlacementMaskTable *pmt, int x, int y){
+    PlacementResult pr;
+    Board mask=pmt->masks[x][y];
 
-            if (!cell){
-                uint32_t mask=0;
-                mask |= (1<<(x));
-                mask |= (1<<(y+9));
-                mask |= (1<<(sq+18));
-                checks=checks & (~mask);
-            }
-        }
+    pr.success=(b & mask).isEmpty();
+    if (!pr.success){
+        pr.scoreDelta=0;
+        return pr;
     }
 
+    b=b | mask;
+    pr.preClear=b;
+
     int count=0;
-    for (int i=0;i<27;i++) {
-        if ((checks >> i) & 1) count++;
+    Board cleared;
+    for (uint32_t lines=pmt->touchedLines[x][y];lines!=0;lines&=lines-1){
+        Board line=lineMasks.masks[__builtin_ctz(lines)];
+        if ((b & line)==line){
+            count++;
+            cleared=cleared | line;
+        }
     }
 
-    int bonus=0;
-    if (count>1) bonus=10*(count-1);
-    int score= count*18+bonus+n;
+    pr.finalResult=b & ~cleared;
+    pr.scoreDelta=scoreForLines(count,pmt->numBlocks);
+    return pr;
+}
 
-    for (int x=0;x<BOARD_SIZE;x++){
-        for (int y=0;y<BOARD_SIZE;y++){
-            int sq=3*(y/3)+(x/3);
-            if ((checks>>(x)) & 1) b.write(x,y,false);
-            if ((checks>>(y+9)) & 1) b.write(x,y,false);
-            if ((checks>>(sq+18)) & 1) b.write(x,y,false);
+Board legalAnchors(Board b, PlacementMaskTable *pmt){
+    // Anchor a is legal if cell a+offset is empty for every block.
+    // Shifting can wrap a block past the row end, but such anchors are
+    // not in pmt->anchors anyway.
+    Board empty=~b;
+    Board res=pmt->anchors;
+    for (int i=0;i<pmt->numBlocks;i++) res=res & (empty>>pmt->blockOffsets[i]);
+    return res;
+}
+
+PlacementResult doPlacement(Board b,Placement pl){
+
+    PlacementMaskTable *pmt=findPlacementMaskTable(pl.piece);
+    int n=pl.piece.numBlocks();
+    Board mask;
+    if (pmt!=nullptr && pl.x<(BOARD_SIZE-pmt->bbox.x) && pl.y<(BOARD_SIZE-pmt->bbox.y)){
+        if (countFullLines(b)>0){
+            return doPlacementMasked(b,pmt->masks[pl.x][pl.y],n);
+        }
+        return doPlacementAt(b,pmt,pl.x,pl.y);
+    }else{
+        // Unknown piece or out of range - build the mask by hand
+        for(int i=0;i<n;i++){
+            Vec2u8 block=pl.piece.getBlock(i);
+            int absX=block.x+pl.x;
+            int absY=block.y+pl.y;
+            if (absX<0 || absX>=BOARD_SIZE || absY<0 || absY>=BOARD_SIZE){
+                PlacementResult pr;
+                pr.success=false;
+                pr.scoreDelta=0;
+                return pr;
+            }
+            mask.write(absX,absY,true);
         }
     }
-    pr.finalResult=b;
-    pr.scoreDelta=score;
-
-    return pr;
+    return doPlacementMasked(b,mask,n);
 }
 
 
@@ -159,6 +248,7 @@ GameState::GameState(){
     score=0;
     board=Board();
     currentPieceIndex=0;
+    fullLines=false;
 }
 void GameState::incrementPieceQueue(){
     currentPieceIndex++;
@@ -176,6 +266,22 @@ PlacementResult GameState::applyPlacement(Placement pl){
     PlacementResult pr=doPlacement(getBoard(),pl);
     if (pr.success){
         board=pr.finalResult;
+        fullLines=false;
+        score+=pr.scoreDelta;
+        incrementPieceQueue();
+    }
+    return pr;
+}
+PlacementResult GameState::applyPlacement(Placement pl, PlacementMaskTable *pmt){
+    PlacementResult pr;
+    if (fullLines){
+        pr=doPlacementMasked(getBoard(),pmt->masks[pl.x][pl.y],pmt->numBlocks);
+    }else{
+        pr=doPlacementAt(getBoard(),pmt,pl.x,pl.y);
+    }
+    if (pr.success){
+        board=pr.finalResult;
+        fullLines=false;
         score+=pr.scoreDelta;
         incrementPieceQueue();
     }
@@ -183,4 +289,5 @@ PlacementResult GameState::applyPlacement(Placement pl){
 }
 void GameState::setBoard(Board b){
     board=b;
+    fullLines=countFullLines(b)>0;
 }
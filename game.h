@@ -15,26 +15,108 @@ typedef struct Placement Placement;
 
 
 
+// Bit (x+y*9) holds cell (x,y). Bits above 80 are always zero.
+typedef unsigned __int128 boardbits_t;
+#define BOARD_CELLS (BOARD_SIZE*BOARD_SIZE)
+constexpr boardbits_t BOARD_ALL_CELLS=(((boardbits_t)1)<<BOARD_CELLS)-1;
+constexpr boardbits_t cellMask(int x, int y){
+    return ((boardbits_t)1)<<(x+y*BOARD_SIZE);
+}
+constexpr boardbits_t columnMask(int x){
+    boardbits_t m=0;
+    for (int y=0;y<BOARD_SIZE;y++) m |= cellMask(x,y);
+    return m;
+}
+
 class Board{
 private:
-    uint32_t bitfield[3];
-    int coord2idx(int x, int y);
-    Vec2u8 idx2coord(int idx);
+    boardbits_t bits;
+    static int coord2idx(int x, int y){
+        return x+y*BOARD_SIZE;
+    }
+    static Vec2u8 idx2coord(int idx){
+        Vec2u8 res;
+        res.x=idx%BOARD_SIZE;
+        res.y=idx/BOARD_SIZE;
+        return res;
+    }
 public:
-    Board();
-    bool read(int x, int y);
-    void write(int x, int y,bool value);
-    bool isEmpty();
-    Vec2u8 getFirstFilledCell();
-    Board bitwiseOR(Board other);
-    Board bitwiseAND(Board other);
-    Board bitwiseNOT();
-    int countCells();
-    bool equal(Board other);
+    constexpr Board():bits(0){}
+    constexpr explicit Board(boardbits_t b):bits(b & BOARD_ALL_CELLS){}
+    boardbits_t getBits(){
+        return bits;
+    }
+    bool read(int x, int y){
+        return (bits>>coord2idx(x,y)) & 1;
+    }
+    void write(int x, int y,bool value){
+        boardbits_t m=cellMask(x,y);
+        bits=(bits & ~m) | (m & -(boardbits_t)value);
+    }
+    bool isEmpty(){
+        return bits==0;
+    }
+    Vec2u8 getFirstFilledCell(){
+        uint64_t lo=(uint64_t)bits;
+        uint64_t hi=(uint64_t)(bits>>64);
+        if (lo) return idx2coord(__builtin_ctzll(lo));
+        if (hi) return idx2coord(64+__builtin_ctzll(hi));
+        return Vec2u8();
+    }
+    Board bitwiseOR(Board other){
+        return Board(bits | other.bits);
+    }
+    Board bitwiseAND(Board other){
+        return Board(bits & other.bits);
+    }
+    Board bitwiseNOT(){
+        return Board(~bits);
+    }
+    int countCells(){
+        return __builtin_popcountll((uint64_t)bits)
+            +__builtin_popcountll((uint64_t)(bits>>64));
+    }
+    bool equal(Board other){
+        return bits==other.bits;
+    }
+
+    // The cells themselves plus their 4-neighbours, computed for the whole
+    // board at once with shifts. Edge columns are masked so rows don't wrap.
+    Board dilate() const {
+        boardbits_t r=bits;
+        r |= (bits<<1) & ~columnMask(0);
+        r |= (bits>>1) & ~columnMask(BOARD_SIZE-1);
+        r |= bits<<BOARD_SIZE;
+        r |= bits>>BOARD_SIZE;
+        return Board(r);
+    }
+    // Board with only the lowest-indexed filled cell set
+    Board lowestCell() const {
+        return Board(bits & -bits);
+    }
+
+    Board operator|(Board other) const { return Board(bits | other.bits); }
+    Board operator&(Board other) const { return Board(bits & other.bits); }
+    Board operator~() const { return Board(~bits); }
+    Board operator^(Board other) const { return Board(bits ^ other.bits); }
+    // Moves every cell n bits down, to (x,y) from x+n%9,y+n/9 away
+    Board operator>>(int n) const { return Board(bits>>n); }
+    bool operator==(Board other) const { return bits==other.bits; }
+    bool operator!=(Board other) const { return bits!=other.bits; }
 };
 
 
 
+// All cells of b 4-connected to start. Returns empty if start is not filled.
+Board floodFillBoard(Board b, Vec2u8 start);
+// Flood fill grown from every cell of seed at once.
+Board floodFillBoard(Board b, Board seed);
+// Writes the size of each 4-connected island into sizes (at most 41 entries
+// on a 9x9 board) and returns the number of islands.
+int labelIslands(Board b, int *sizes);
+
+
+// If the placement fails, only success and scoreDelta (0) are set
 struct PlacementResult{
     bool success;
     Board preClear;
@@ -46,11 +128,56 @@ typedef struct PlacementResult PlacementResult;
 PlacementResult doPlacement(Board b,Placement pl);
 
 
+// Pre-shifted board masks of a single piece, one for every anchor
+// position. Only entries with x<=(8-bbox.x) and y<=(8-bbox.y) are valid.
+struct PlacementMaskTable{
+    Piece piece;
+    int numBlocks;
+    Vec2u8 bbox;
+    // Upper bound on doPlacement's scoreDelta at any anchor, from the
+    // number of rows, columns and squares the piece touches there.
+    int maxScoreDelta;
+    Board masks[BOARD_SIZE][BOARD_SIZE]; // [x][y]
+    // Lines (bit i for line i, as in countFullLines) the piece has a
+    // cell on at each anchor. Only these can be filled by placing it.
+    uint32_t touchedLines[BOARD_SIZE][BOARD_SIZE];
+    // Bit offset of each block from the anchor cell
+    int blockOffsets[5];
+    // Anchors that keep the whole piece on the board
+    Board anchors;
+};
+typedef struct PlacementMaskTable PlacementMaskTable;
+
+void buildPlacementMaskTable(Piece p, PlacementMaskTable *pmt);
+// Build tables for every piece in the generator's pool. Call once at startup.
+void initPlacementTables(PieceGenerator *pg);
+// Returns nullptr if the piece was not in the pool given to initPlacementTables.
+// A hash lookup on the piece's raw bits, cheap enough for every node.
+PlacementMaskTable* findPlacementMaskTable(Piece p);
+// Pool table for p, or a table built into scratch for pieces outside the pool.
+PlacementMaskTable* getPlacementMaskTable(Piece p, PlacementMaskTable *scratch);
+// Highest maxScoreDelta of any piece in the pool
+int getPoolMaxScoreDelta();
+// Number of full rows, columns and squares on the board
+int countFullLines(Board b);
+// Collision test, commit and line clears with a pre-shifted mask.
+PlacementResult doPlacementMasked(Board b, Board mask, int numBlocks);
+// Same as doPlacementMasked at anchor (x,y) of the table, but only tests
+// the lines the piece touches there. Callers must make sure b has no full
+// lines: boards left by a placement never do, but one set from outside
+// may.
+PlacementResult doPlacementAt(Board b, PlacementMaskTable *pmt, int x, int y);
+// Every anchor (x,y) where the piece fits on b, as the cell at (x,y).
+// One shift and AND of the empty cells per block of the piece.
+Board legalAnchors(Board b, PlacementMaskTable *pmt);
+
+
 class GameState{
 private:
     int32_t score;
     Board board;
     uint32_t currentPieceIndex;
+    bool fullLines; // board has full lines, so doPlacementAt can't be used
 public:
     GameState();
     void incrementPieceQueue();
@@ -59,4 +186,5 @@ public:
     void setBoard(Board b);
     int32_t getScore();
     PlacementResult applyPlacement(Placement pl);
+    PlacementResult applyPlacement(Placement pl, PlacementMaskTable *pmt);
 };
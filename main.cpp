@@ -5,20 +5,29 @@
 #include "stdbool.h"
 #include "assert.h"
 #include "limits.h"
+#include "math.h"
 #include "time.h"
 #include "getopt.h"
+#include "unistd.h"
+#include "sys/wait.h"
 
 // C++ Libraries
 #include <thread>
 #include <iostream>
 #include <chrono>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+#include <algorithm>
 
 // Local includes
 #include "piece.h"
 #include "printutil.h"
 #include "game.h"
 #include "woodoku_client.h"
+#include "transposition.h"
+#include "bench.h"
 
 // A lot of code assumes 9x9 board size implicitly.
 // You should probably leave this alone.
@@ -33,13 +42,27 @@ int optRandsearchMax=30;
 int optRanddearchMin=10;
 int optStopAfterSteps=0;
 int optMsPerTurn=3000;
+int optSplitDepth=4;
+int optTTSizeMB=64;
+int optFitnessCacheKB=256;
+int optChanceSamples=8;
+int optBatch=0;
+int optBatchJobs=0;
+const char *optBatchOut="batch.csv";
 bool optServerGame=false;
 const char *optServerPort="21991";
 const char *optServerAddr="127.0.0.1";
 bool optDisableBoardFitness=false;
 bool optDeterministic=false;
+bool optDisablePruning=false;
+bool optFixedOrder=false;
+bool optDisableSharedPrefix=false;
+bool optDisablePonder=false;
+bool optBench=false;
+bool optDisableTimeManager=false;
 int optPreviewPieces=5;
 bool optPrintPieces=false;
+const char *optStatsOut=nullptr;
 
 std::string helpString="\
 WoodokuAI\n\
@@ -51,22 +74,44 @@ Tweakable values\n\
 --seed N manually set seed, 0 to randomize (default 0)\n\
 --search-depth N Max search depth (default 10)\n\
 --randsearch-max N Max randsearch iterations (default 30) \n\
---randsearch-min N Min randsearch iterations (default 10) \n\
+--randsearch-min N Min randsearch iterations. More are only run while\n\
+    the vote is undecided (default 10) \n\
 --stop-after-steps N 0 to keep going forever (default 0)\n\
 --millisec-per-turn N (default 3000) \n\
+--split-depth N Split searches this deep across threads, 0 to disable (default 4)\n\
+--tt-size-mb N Transposition table size in MB, 0 to disable (default 64)\n\
+--fitness-cache-kb N Leaf fitness cache size per thread in KB, 0 to\n\
+    disable (default 256)\n\
+--chance-samples N Turns sampled at each unknown turn in expectimax,\n\
+    0 to vote over randsearch runs instead (default 8)\n\
 \n\
 Flags \n\
 --disable-board-fitness Disable board fitness heuristic. \n\
 --deterministic Makes all pieces visible. Not game-accurate.\n\
+--disable-pruning Search every subtree instead of branch-and-bound. Same moves, slower.\n\
+--fixed-order Place each turn's 3 pieces in the order they were dealt.\n\
+--disable-shared-prefix Let every randsearch run search the known pieces again.\n\
+--bench Run the micro-benchmarks and exit.\n\
+--disable-time-manager Always search for --millisec-per-turn, unless all\n\
+    depths finish sooner.\n\
 \n\
 Server \n\
 --server-game Connect to a server \n\
 --server-addr ADDR Server address (default 127.0.0.1)\n\
 --server-port PORT Server port number (default 21991)\n\
+--disable-ponder Leave the cores idle while waiting for the server.\n\
+\n\
+Batch \n\
+--batch N Play N games without drawing, one seed each, and write\n\
+    per-game stats as CSV (default 0, play one game normally)\n\
+--batch-jobs N Games played at once, 0 for cores/threads (default 0)\n\
+--batch-out FILE CSV output file (default batch.csv)\n\
 \n\
 Visuals \n\
 --preview-pieces N Number of pieces to preview. Visual only. (default 5)\n\
---print-pieces Print all pieces available, before starting the game.\n";
+--print-pieces Print all pieces available, before starting the game.\n\
+--stats-out FILE Append each turn's search statistics to FILE, one JSON\n\
+    object per line.\n";
 
 struct option longopts[]={
     {"help",                    no_argument,NULL,401},
@@ -77,13 +122,27 @@ struct option longopts[]={
     {"randsearch-min",    required_argument,NULL,505},
     {"stop-after-steps",  required_argument,NULL,506},
     {"millisec-per-turn", required_argument,NULL,507},
+    {"split-depth",       required_argument,NULL,508},
+    {"tt-size-mb",        required_argument,NULL,509},
+    {"chance-samples",    required_argument,NULL,510},
+    {"batch",             required_argument,NULL,511},
+    {"batch-jobs",        required_argument,NULL,512},
+    {"batch-out",         required_argument,NULL,513},
+    {"fitness-cache-kb",  required_argument,NULL,514},
     {"server-game",             no_argument,NULL,801},
     {"server-addr",       required_argument,NULL,802},
     {"server-port",       required_argument,NULL,803},
+    {"disable-ponder",          no_argument,NULL,804},
     {"disable-board-fitness",   no_argument,NULL,602},
     {"deterministic",           no_argument,NULL,603},
+    {"disable-pruning",         no_argument,NULL,604},
+    {"fixed-order",             no_argument,NULL,605},
+    {"disable-shared-prefix",   no_argument,NULL,606},
+    {"bench",                   no_argument,NULL,607},
+    {"disable-time-manager",    no_argument,NULL,608},
     {"preview-pieces",    required_argument,NULL,701},
-    {"print-pieces",            no_argument,NULL,702}
+    {"print-pieces",            no_argument,NULL,702},
+    {"stats-out",         required_argument,NULL,703}
 };
 void parse_options(int argc, char** argv){
     while(1){
@@ -100,17 +159,38 @@ void parse_options(int argc, char** argv){
             case 505: optRanddearchMin=atoi(optarg);  break;
             case 506: optStopAfterSteps=atoi(optarg); break;
             case 507: optMsPerTurn=atoi(optarg);      break;
+            case 508: optSplitDepth=atoi(optarg);     break;
+            case 509: optTTSizeMB=atoi(optarg);       break;
+            case 510: optChanceSamples=atoi(optarg);  break;
+            case 511: optBatch=atoi(optarg);          break;
+            case 512: optBatchJobs=atoi(optarg);      break;
+            case 513: optBatchOut=optarg;             break;
+            case 514: optFitnessCacheKB=atoi(optarg); break;
             case 801: optServerGame=true;             break;
             case 802: optServerAddr=optarg;           break;
             case 803: optServerPort=optarg;           break;
+            case 804: optDisablePonder=true;          break;
             case 602: optDisableBoardFitness=true;    break;
             case 603: optDeterministic=true;          break;
+            case 604: optDisablePruning=true;         break;
+            case 605: optFixedOrder=true;             break;
+            case 606: optDisableSharedPrefix=true;    break;
+            case 607: optBench=true;                  break;
+            case 608: optDisableTimeManager=true;     break;
             case 701: optPreviewPieces=atoi(optarg);  break;
             case 702: optPrintPieces=true;            break;
+            case 703: optStatsOut=optarg;             break;
         }
 
         if (opt==-1) break;
     }
+    // Search bounds keep a gain per depth of the piece queue, and TT
+    // entries pack the remaining depth into TT_MAX_REMAINING
+    int maxSearchDepth=std::min(PIECEQUEUE_SIZE,TT_MAX_REMAINING);
+    if (optMaxSearchDepth>maxSearchDepth){
+        printf("--search-depth can be at most %d\n",maxSearchDepth);
+        exit(-1);
+    }
 
     printf("WoodokuAI\n");
     printf("  #Threads: %d\n",optNumThreads);
@@ -120,11 +200,21 @@ void parse_options(int argc, char** argv){
     printf("  RandSearch Min: %d\n",optRanddearchMin);
     printf("  Stop after: %d\n",optStopAfterSteps);
     printf("  ms per turn: %d\n",optMsPerTurn);
+    printf("  Split depth: %d\n",optSplitDepth);
+    printf("  TT size: %d MB\n",optTTSizeMB);
+    printf("  Fitness cache: %d KB\n",optFitnessCacheKB);
+    printf("  Chance samples: %d\n",optChanceSamples);
+    printf("  Batch: %d\n",optBatch);
     printf("  Server game: %c\n",optServerGame?'Y':'N');
     printf("  Server addr: %s\n",optServerAddr);
     printf("  Server port: %s\n",optServerPort);
+    printf("  Disable Ponder: %c\n",optDisablePonder?'Y':'N');
     printf("  Disable Board Fitness: %c\n",optDisableBoardFitness?'Y':'N');
     printf("  Deterministic: %c\n",optDeterministic?'Y':'N');
+    printf("  Disable Pruning: %c\n",optDisablePruning?'Y':'N');
+    printf("  Fixed Order: %c\n",optFixedOrder?'Y':'N');
+    printf("  Disable Shared Prefix: %c\n",optDisableSharedPrefix?'Y':'N');
+    printf("  Disable Time Manager: %c\n",optDisableTimeManager?'Y':'N');
     printf("  Preview Pieces: %d\n",optPreviewPieces);
     printf("  Print Pieces: %c\n",optPrintPieces?'Y':'N');
 }
@@ -135,79 +225,113 @@ uint64_t timeSinceEpochMillisec() {
 }
 
 
-Board floodFillBoard(Board b, Vec2u8 start){
-    Board boundary;
-    Board fillResult;
-    boundary.write(start.x,start.y,true);
-    while (!boundary.isEmpty()){
-        Vec2u8 target=boundary.getFirstFilledCell();
-        if (b.read(target.x,target.y)){
-            // is filled.
-            fillResult.write(target.x,target.y,true);
-
-            Vec2u8 candidate;
-            for(int i=0;i<4;i++){
-                if (i==0){ //+X
-                    if ((target.x+1)<BOARD_SIZE){
-                        candidate.x=target.x+1;
-                        candidate.y=target.y;
-                    }else continue;
-                }
-                if (i==1){ //+Y
-                    if ((target.y+1)<BOARD_SIZE){
-                        candidate.y=target.y+1;
-                        candidate.x=target.x;
-                    }else continue;
-                }
-                if (i==2){ //-X
-                    if ((target.x)>0){
-                        candidate.x=target.x-1;
-                        candidate.y=target.y;
-                    }else continue;
-                }
-                if (i==3){ //-Y
-                    if ((target.y)>0){
-                        candidate.y=target.y-1;
-                        candidate.x=target.x;
-                    }else continue;
-                }
-
-                if (fillResult.read(candidate.x,candidate.y)) continue;
-                if (boundary.read(candidate.x,candidate.y)) continue;
+// Only islands smaller than this count towards islandness
+#define SMALL_ISLAND 5
 
-                boundary.write(candidate.x,candidate.y,true);
-
-            }
-        }
-        boundary.write(target.x,target.y,false);
+int calculateIslandness(Board b){
+    int sizes[BOARD_CELLS/2+1];
+    int numIslands=labelIslands(b,sizes);
+    int n=0;
+    for (int i=0;i<numIslands;i++){
+        int cellcount=sizes[i];
+        if (cellcount<SMALL_ISLAND) n+=10*(SMALL_ISLAND-cellcount);
+        //else if (cellcount<10) n+=2;
     }
-    return fillResult;
+    return n;
 }
 
-int calculateIslandness(Board b){
+// Islandness of just the islands of b that have a cell in seed. A fill
+// stops growing once it is too big to count, so large islands cost a few
+// steps instead of a whole flood fill. Whatever of a large island is
+// left in seed gets filled again, which adds nothing.
+int islandnessNear(Board b, Board seed){
     int n=0;
-    while (!b.isEmpty()){
-        Vec2u8 start=b.getFirstFilledCell();
-        Board island=floodFillBoard(b,start);
-
-        int cellcount=island.countCells();
-        if (cellcount<5) n+=10*(5-cellcount);
-        //else if (cellcount<10) n+=2;
-        //remove this island
-        b=b.bitwiseAND(island.bitwiseNOT());
+    seed=seed & b;
+    while (!seed.isEmpty()){
+        Board fill=seed.lowestCell();
+        int cells=1;
+        while (cells<SMALL_ISLAND){
+            Board next=fill.dilate() & b;
+            if (next==fill) break;
+            fill=next;
+            cells=fill.countCells();
+        }
+        if (cells<SMALL_ISLAND) n+=10*(SMALL_ISLAND-cells);
+        seed=seed & ~fill;
     }
     return n;
 }
 
+int fitnessFromIslandness(int islandnessP, int islandnessN, int emptycells){
+    return -(islandnessP+islandnessN*3)+emptycells*2;
+    //return emptycells;
+    //return -(islandnessN)+emptycells*10;
+}
+
 int calculateBoardFitness(Board b){
     if (optDisableBoardFitness) return 0;
     Board negboard=b.bitwiseNOT();
     int islandnessP=calculateIslandness(b);
     int islandnessN=calculateIslandness(negboard);
     int emptycells=negboard.countCells();
-    return -(islandnessP+islandnessN*3)+emptycells*2;
-    //return emptycells;
-    //return -(islandnessN)+emptycells*10;
+    return fitnessFromIslandness(islandnessP,islandnessN,emptycells);
+}
+
+// Island summary of a board, for scoring boards one placement away
+struct IslandSummary{
+    Board board;
+    // Cells of the islands that count towards islandness
+    Board smallP;
+    Board smallN;
+    int islandnessP;
+    int islandnessN;
+};
+typedef struct IslandSummary IslandSummary;
+
+// calculateIslandness(b), also collecting the cells of small islands
+int collectSmallIslands(Board b, Board *small){
+    int n=0;
+    *small=Board();
+    while (!b.isEmpty()){
+        Board island=floodFillBoard(b,b.lowestCell());
+        int cellcount=island.countCells();
+        if (cellcount<SMALL_ISLAND){
+            n+=10*(SMALL_ISLAND-cellcount);
+            *small=*small | island;
+        }
+        b=b & ~island;
+    }
+    return n;
+}
+
+void summarizeIslands(Board b, IslandSummary *summary){
+    summary->board=b;
+    summary->islandnessP=collectSmallIslands(b,&summary->smallP);
+    summary->islandnessN=collectSmallIslands(~b,&summary->smallN);
+}
+
+// Past this many changed cells (two cleared lines) the changes reach
+// most islands anyway, and a full evaluation is cheaper
+#define INCREMENTAL_FITNESS_MAX_CHANGED (2*BOARD_SIZE)
+
+// Same as calculateBoardFitness(b), for a board that differs from
+// parent's by a placement and the lines it cleared. Islands with no cell
+// on or next to a changed cell are the same in both boards, so only
+// those near the change are scored again. On the parent's side those are
+// already known, and usually there are none.
+int calculateBoardFitnessFrom(IslandSummary *parent, Board b){
+    if (optDisableBoardFitness) return 0;
+    Board changed=parent->board ^ b;
+    if (changed.countCells()>INCREMENTAL_FITNESS_MAX_CHANGED){
+        return calculateBoardFitness(b);
+    }
+    Board near=changed.dilate();
+    Board negboard=~b;
+    int islandnessP=parent->islandnessP
+        -islandnessNear(parent->smallP,near)+islandnessNear(b,near);
+    int islandnessN=parent->islandnessN
+        -islandnessNear(parent->smallN,near)+islandnessNear(negboard,near);
+    return fitnessFromIslandness(islandnessP,islandnessN,negboard.countCells());
 }
 
 struct DFSResult{
@@ -216,6 +340,12 @@ struct DFSResult{
     int32_t scoreDelta;
     bool valid;
     bool computationInterrupted;
+    // Some subtree was skipped by the bound. The result is still right for
+    // picking a move, but not exact enough to cache.
+    bool bounded;
+    // Which of the node's placeable pieces bestPlacement uses, counted
+    // from the current step. Only breaks ties.
+    uint8_t slot;
 };
 typedef struct DFSResult DFSResult;
 
@@ -225,94 +355,542 @@ int32_t calculateCompositeScore(int sd,int bf){
     //return sd*10;
 }
 
-DFSResult search(GameState initialState,int depth,int targetDepth,int32_t baseScore, PieceQueue *pq, bool *killRequest){
-
+DFSResult makeNullResult(){
     DFSResult nullResult;
     nullResult.valid=false;
     nullResult.computationInterrupted=false;
+    nullResult.bounded=false;
+    nullResult.slot=0;
     nullResult.boardFitness=-123456;
     nullResult.scoreDelta=-123457;
+    return nullResult;
+}
 
-    if (*killRequest) {
-        nullResult.computationInterrupted=true;
-        return nullResult;
+// Position of a result's move in the plain search order: pieces in queue
+// order, then anchors in x-major order
+int moveIndex(DFSResult dr){
+    return dr.slot*BOARD_CELLS+dr.bestPlacement.x*BOARD_SIZE+dr.bestPlacement.y;
+}
+
+// Copy dr into optimalResult if it is valid and scores greater.
+// Ties go to the move that comes first in the plain search order, so the
+// result does not depend on the order moves were tried in.
+void mergeResult(DFSResult *optimalResult, DFSResult dr){
+    if (!dr.valid) return;
+    if (!optimalResult->valid){
+        *optimalResult=dr;
+        return;
     }
-    assert (depth<targetDepth);
+    int32_t cs_this=calculateCompositeScore(
+        dr.scoreDelta,dr.boardFitness
+    );
+    int32_t cs_optimal=calculateCompositeScore(
+        optimalResult->scoreDelta,optimalResult->boardFitness
+    );
+    if (cs_this>cs_optimal){
+        *optimalResult=dr;
+    }else if (cs_this==cs_optimal &&
+        moveIndex(dr)<moveIndex(*optimalResult)){
+        *optimalResult=dr;
+    }
+}
 
+// One past the last step whose piece may be placed at step. Any piece
+// left in the current turn can go next, as in the real game.
+uint32_t placeableEnd(PieceQueue *pq, uint32_t step){
+    if (optFixedOrder) return step+1;
+    return pq->turnEnd(step);
+}
+// Placing the piece at idx would repeat one of the pieces in [step,idx)
+bool isRepeatedPiece(PieceQueue *pq, uint32_t step, uint32_t idx){
+    Piece p=pq->getPiece(idx);
+    for (uint32_t i=step;i<idx;i++){
+        if (pq->getPiece(i).equal(p)) return true;
+    }
+    return false;
+}
 
-    Piece currentPiece;
+// Branch-and-bound state of one SearchRequest. The composite score of
+// every leaf is relative to the request's root, so one incumbent serves
+// the whole tree. A subtree is skipped only if its upper bound is strictly
+// below the incumbent, so ties (and with them the chosen move) are the
+// same as in the exhaustive search.
+// Below a chance node a leaf is no longer a lower bound on the root, so
+// bounds are only passed down paths without one. A chance node raises the
+// incumbent with its mean instead.
+struct SearchBounds{
+    std::atomic<int32_t> incumbent; // best full-depth composite so far
+    // maxGainFrom[d]: upper bound on the score gained placing the pieces
+    // of depths d..targetDepth-1
+    int32_t maxGainFrom[PIECEQUEUE_SIZE+1];
+};
+typedef struct SearchBounds SearchBounds;
+
+void initSearchBounds(SearchBounds *bounds, PieceQueue *pq, uint32_t step, int targetDepth){
+    bounds->incumbent=INT32_MIN;
+    bounds->maxGainFrom[targetDepth]=0;
+    for (int d=targetDepth-1;d>=0;d--){
+        // The piece placed at depth d is one of those left in its turn
+        uint32_t s=step+d;
+        uint32_t first=s;
+        if (!optFixedOrder){
+            first=s-s%PIECES_PER_TURN;
+            if (first<step) first=step;
+        }
+        int32_t maxDelta=0;
+        if (!pq->isVisible(s)){
+            // Not dealt yet, could be any piece of the pool
+            maxDelta=getPoolMaxScoreDelta();
+        }else{
+            for (uint32_t i=first;i<placeableEnd(pq,s);i++){
+                PlacementMaskTable localTable;
+                PlacementMaskTable *pmt=getPlacementMaskTable(pq->getPiece(i),&localTable);
+                if (pmt->maxScoreDelta>maxDelta) maxDelta=pmt->maxScoreDelta;
+            }
+        }
+        bounds->maxGainFrom[d]=bounds->maxGainFrom[d+1]+maxDelta;
+    }
+}
+void raiseIncumbent(SearchBounds *bounds, int32_t cs){
+    int32_t cur=bounds->incumbent.load(std::memory_order_relaxed);
+    while (cs>cur && !bounds->incumbent.compare_exchange_weak(cur,cs,std::memory_order_relaxed));
+}
+// Highest fitness any board with emptyCells empty cells can get
+int32_t maxBoardFitness(int emptyCells){
+    if (optDisableBoardFitness) return 0;
+    return emptyCells*2;
+}
 
-    assert (pq->isVisible(initialState.getCurrentStepNum()));
-    currentPiece=pq->getPiece(initialState.getCurrentStepNum());
-    //printf("Depth %d\n",depth);
-    //drawPiece(currentPiece);
+DFSResult search(GameState initialState,int depth,int targetDepth,int32_t baseScore, PieceQueue *pq, std::atomic<bool> *killRequest, Placement *hint=nullptr, SearchBounds *bounds=nullptr);
 
+// Shared by all search threads. nullptr if disabled.
+TranspositionTable *transpositionTable=nullptr;
+// Pieces dealt in random samples and at chance nodes
+PieceGenerator *randSearchPG;
+// Search counters of one thread. Only the owning thread writes them,
+// and they are read between searches while the workers are parked.
+// Aligned so that no two threads' counters share a cache line.
+struct alignas(64) SearchCounters{
+    uint64_t nodes;            // placements applied and searched below
+    uint64_t placementsTried;  // anchors tested for fit
+    uint64_t placementsFailed; // anchors where the piece didn't fit
+    uint64_t fitnessEvals;
+    uint64_t fitnessCacheHits; // fitnessEvals answered by fitnessCache
+    uint64_t cutoffs;          // subtrees skipped by branch-and-bound
+    uint64_t ttHits;
+    int64_t busyUs;            // time spent running requests
+};
+typedef struct SearchCounters SearchCounters;
+// For searches on the main thread, as in --bench
+SearchCounters mainThreadCounters;
+thread_local SearchCounters *threadCounters=&mainThreadCounters;
+
+// Leaf fitness of recently scored boards, one direct-mapped table per
+// thread so lookups need no locks. A new board simply replaces whatever
+// was in its slot.
+struct FitnessCacheEntry{
+    uint64_t lo; // cells 0-63
+    uint64_t hi; // cells 64-80, bit 31 if used, fitness in bits 32-63
+};
+typedef struct FitnessCacheEntry FitnessCacheEntry;
+thread_local std::vector<FitnessCacheEntry> fitnessCache;
 
+// calculateBoardFitness(b) through fitnessCache. parent, if given, is
+// used on a miss as in calculateBoardFitnessFrom.
+int cachedBoardFitness(Board b, IslandSummary *parent){
+    if (optDisableBoardFitness) return 0;
+    if (optFitnessCacheKB<=0){
+        if (parent!=nullptr) return calculateBoardFitnessFrom(parent,b);
+        return calculateBoardFitness(b);
+    }
+    if (fitnessCache.empty()){
+        size_t n=1;
+        while (n*2*sizeof(FitnessCacheEntry)<=(size_t)optFitnessCacheKB*1024) n*=2;
+        fitnessCache.assign(n,FitnessCacheEntry{0,0});
+    }
+    boardbits_t bits=b.getBits();
+    uint64_t lo=(uint64_t)bits;
+    uint64_t hi=(uint64_t)(bits>>64) | (1ULL<<31);
+    FitnessCacheEntry &e=fitnessCache[mix64(lo^mix64(hi)) & (fitnessCache.size()-1)];
+    if (e.lo==lo && (uint32_t)e.hi==hi){
+        threadCounters->fitnessCacheHits++;
+        return (int32_t)(e.hi>>32);
+    }
+    int fitness;
+    if (parent!=nullptr) fitness=calculateBoardFitnessFrom(parent,b);
+    else fitness=calculateBoardFitness(b);
+    e.lo=lo;
+    e.hi=hi | ((uint64_t)(uint32_t)fitness<<32);
+    return fitness;
+}
 
+// Apply one placement of the current piece and search everything below it.
+// Returns an invalid result if the placement fails or every future dies.
+// leafParent, if given, is the island summary of initialState's board,
+// used to score leaves incrementally.
+DFSResult searchPlacement(GameState initialState, PlacementMaskTable *pmt, int x, int y, int depth,int targetDepth,int32_t baseScore, PieceQueue *pq, std::atomic<bool> *killRequest, SearchBounds *bounds=nullptr, IslandSummary *leafParent=nullptr){
+    Placement pl;
+    pl.piece=pmt->piece;
+    pl.x=x;
+    pl.y=y;
+
+    GameState inState=initialState;
+
+    threadCounters->placementsTried++;
+    PlacementResult pr=inState.applyPlacement(pl,pmt);
+    if (!pr.success){
+        threadCounters->placementsFailed++;
+        return makeNullResult();
+    }
+    threadCounters->nodes++;
+
+    // DFS result until here
+    DFSResult dr=makeNullResult();
+    dr.scoreDelta=inState.getScore()-baseScore;
+    dr.bestPlacement=pl;
+    dr.valid=true;
+
+    if (depth+1>=targetDepth){
+        // Leaf. Fitness is at most twice the empty cells, which is enough
+        // to skip most fitness evaluations once a good leaf is known.
+        if (bounds!=nullptr){
+            int32_t ub=calculateCompositeScore(dr.scoreDelta,
+                maxBoardFitness(pr.finalResult.bitwiseNOT().countCells()));
+            if (ub<bounds->incumbent.load(std::memory_order_relaxed)){
+                threadCounters->cutoffs++;
+                DFSResult skipped=makeNullResult();
+                skipped.bounded=true;
+                return skipped;
+            }
+        }
+        threadCounters->fitnessEvals++;
+        dr.boardFitness=cachedBoardFitness(pr.finalResult,leafParent);
+        if (bounds!=nullptr){
+            raiseIncumbent(bounds,calculateCompositeScore(dr.scoreDelta,dr.boardFitness));
+        }
+        return dr;
+    }
 
+    // Try recursing
+    if (depth+1<targetDepth){
+        // The subtree's value only depends on the board and the pieces
+        // left to place, so it can be shared between placement orders,
+        // depths and random samples with the same upcoming pieces.
+        int remaining=targetDepth-(depth+1);
+        int32_t gainSoFar=dr.scoreDelta;
+        uint64_t key=0;
+        TTValue ttv;
+        bool hit=false;
+        if (transpositionTable!=nullptr){
+            key=hashPosition(pr.finalResult,pq,inState.getCurrentStepNum(),remaining,!optFixedOrder);
+            hit=transpositionTable->probe(key,remaining,&ttv);
+            if (hit) threadCounters->ttHits++;
+        }
+        if (hit && ttv.upperBound){
+            // Left by a pruned search. Good enough if it still can't reach
+            // the incumbent, otherwise search it properly.
+            if (bounds!=nullptr && calculateCompositeScore(gainSoFar+ttv.scoreGain,
+                    ttv.boardFitness)<=bounds->incumbent.load(std::memory_order_relaxed)){
+                threadCounters->cutoffs++;
+                DFSResult skipped=makeNullResult();
+                skipped.bounded=true;
+                return skipped;
+            }
+            hit=false;
+        }
+        if (hit){
+            if (bounds!=nullptr && ttv.valid){
+                raiseIncumbent(bounds,calculateCompositeScore(
+                    gainSoFar+ttv.scoreGain,ttv.boardFitness));
+            }
+        }else{
+            if (bounds!=nullptr){
+                int32_t ub=calculateCompositeScore(
+                    gainSoFar+bounds->maxGainFrom[depth+1],
+                    maxBoardFitness(BOARD_CELLS));
+                if (ub<bounds->incumbent.load(std::memory_order_relaxed)){
+                    threadCounters->cutoffs++;
+                    DFSResult skipped=makeNullResult();
+                    skipped.bounded=true;
+                    return skipped;
+                }
+            }
+            DFSResult dr_recursed=search(inState,depth+1,targetDepth,baseScore, pq, killRequest, nullptr, bounds);
+            ttv.valid=dr_recursed.valid;
+            ttv.scoreGain=dr_recursed.valid?(dr_recursed.scoreDelta-gainSoFar):0;
+            ttv.boardFitness=dr_recursed.boardFitness;
+            ttv.upperBound=false;
+            dr.bounded=dr_recursed.bounded;
+            TTValue stored=ttv;
+            if (dr_recursed.bounded){
+                // Everything cut off scored below the incumbent. Unless the
+                // result beats it, that is all that is known: store the
+                // incumbent as an upper bound.
+                int32_t incumbent=bounds->incumbent.load(std::memory_order_relaxed);
+                if (!dr_recursed.valid || calculateCompositeScore(
+                        dr_recursed.scoreDelta,dr_recursed.boardFitness)<incumbent){
+                    stored.upperBound=true;
+                    stored.scoreGain=0;
+                    stored.boardFitness=incumbent-calculateCompositeScore(gainSoFar,0);
+                }
+            }
+            // Interrupted subtrees are incomplete, never cache them
+            if (transpositionTable!=nullptr &&
+                !killRequest->load(std::memory_order_relaxed)){
+                transpositionTable->store(key,remaining,stored);
+            }
+        }
+        if (ttv.valid){
+            // Take the final score
+            dr.scoreDelta=gainSoFar+ttv.scoreGain;
+            dr.boardFitness=ttv.boardFitness;
+        }else{
+            // If none of the the futures lead anywhere
+            // this branch is dead
+            dr.valid=false;
+        }
+    }
+    return dr;
+}
 
-    DFSResult optimalResult=nullResult;
+// Move ordering of one searchPiece call, kept off the call stack. With
+// byte-sized placement indices, what a node touches fits in a few cache
+// lines, and the recursion's stack frames stay small.
+struct SearchFrame{
+    // Placement indices (x*rangeY+y) in the order they will be tried
+    uint8_t order[BOARD_CELLS];
+    uint8_t plain[BOARD_CELLS];
+    int16_t gains[BOARD_CELLS];
+    // Mask table for pieces outside the pool, rarely used
+    PlacementMaskTable scratchTable;
+};
+typedef struct SearchFrame SearchFrame;
+// One frame per searchPiece call active on this thread, allocated on the
+// thread's first search. Calls nest at most once per depth.
+thread_local std::vector<SearchFrame> searchFrames;
+thread_local int searchFrameTop=0;
+
+// Try every anchor of the piece at pq's current step.
+// hint, if given, is tried before every other placement of this piece.
+// With bounds, line-clearing placements are tried next so that good
+// leaves are found early, and subtrees that can't beat them are skipped.
+DFSResult searchPiece(GameState initialState,int depth,int targetDepth,int32_t baseScore, PieceQueue *pq, std::atomic<bool> *killRequest, Placement *hint, SearchBounds *bounds){
+    Piece currentPiece=pq->getPiece(initialState.getCurrentStepNum());
+    //printf("Depth %d\n",depth);
+    //drawPiece(currentPiece);
+
+    if (searchFrames.empty()) searchFrames.resize(optMaxSearchDepth+1);
+    assert(searchFrameTop<(int)searchFrames.size());
+    SearchFrame *frame=&searchFrames[searchFrameTop];
+
+    PlacementMaskTable *pmt=getPlacementMaskTable(currentPiece,&frame->scratchTable);
+
+    DFSResult optimalResult=makeNullResult();
     //Prune loops a little with some simple bounding box calculation
     Vec2u8 bbox;
-    bbox=currentPiece.calculateBoundingBox();
-    for (int x=0;x<(9-bbox.x);x++){
-        for (int y=0;y<(9-bbox.y);y++){
+    bbox=pmt->bbox;
+    int rangeX=BOARD_SIZE-bbox.x;
+    int rangeY=BOARD_SIZE-bbox.y;
+    Board b=initialState.getBoard();
+    Board legal=legalAnchors(b,pmt);
+    int numLegal=legal.countCells();
+    // searchPlacement counts the legal anchors, so only the rest here
+    threadCounters->placementsTried+=rangeX*rangeY-numLegal;
+    threadCounters->placementsFailed+=rangeX*rangeY-numLegal;
+    // Dead end for this piece
+    if (numLegal==0) return optimalResult;
+
+    int hintIdx=-1;
+    if (hint!=nullptr && hint->piece.equal(currentPiece) &&
+        hint->x<rangeX && hint->y<rangeY && legal.read(hint->x,hint->y)){
+        hintIdx=hint->x*rangeY+hint->y;
+    }
 
-            Placement pl;
-            pl.piece=currentPiece;
-            pl.x=x;
-            pl.y=y;
+    // Only placements that fit are listed
+    uint8_t *order=frame->order;
+    int numOrder=0;
+    if (hintIdx>=0) order[numOrder++]=hintIdx;
+    if (bounds!=nullptr && depth+1<targetDepth){
+        // Line clears first, biggest first.
+        int16_t *gains=frame->gains;
+        int numClearing=0;
+        uint8_t *plain=frame->plain;
+        int numPlain=0;
+        for (Board rest=legal;!rest.isEmpty();rest=rest & ~rest.lowestCell()){
+            Vec2u8 a=rest.getFirstFilledCell();
+            int i=a.x*rangeY+a.y;
+            if (i==hintIdx) continue;
+            PlacementResult pr=doPlacementAt(b,pmt,a.x,a.y);
+            if (pr.scoreDelta<=pmt->numBlocks){
+                plain[numPlain++]=i;
+                continue;
+            }
+            // insertion sort, stable for equal gains
+            int j=numOrder+numClearing;
+            while (j>numOrder && gains[j-1]<pr.scoreDelta){
+                order[j]=order[j-1];
+                gains[j]=gains[j-1];
+                j--;
+            }
+            order[j]=i;
+            gains[j]=pr.scoreDelta;
+            numClearing++;
+        }
+        numOrder+=numClearing;
+        for (int i=0;i<numPlain;i++) order[numOrder++]=plain[i];
+    }else{
+        for (Board rest=legal;!rest.isEmpty();rest=rest & ~rest.lowestCell()){
+            Vec2u8 a=rest.getFirstFilledCell();
+            int i=a.x*rangeY+a.y;
+            if (i!=hintIdx) order[numOrder++]=i;
+        }
+    }
 
-            GameState inState=initialState;
-
-            PlacementResult pr=inState.applyPlacement(pl);
-            if (pr.success){
-                //printf("Depth %d X %d Y %d\n",depth,x,y);
-                // DFS result until here
-                DFSResult dr;
-                dr.scoreDelta=inState.getScore()-baseScore;
-                dr.boardFitness=calculateBoardFitness(pr.finalResult);
-                dr.bestPlacement=pl;
-                dr.valid=true;
-                dr.computationInterrupted=false;
-
-                // Try recursing
-                if (depth+1<targetDepth){
-                    DFSResult dr_recursed=search(inState,depth+1,targetDepth,baseScore, pq, killRequest);
-                    if (dr_recursed.valid){
-                        // Take the final score
-                        dr.scoreDelta=dr_recursed.scoreDelta;
-                        dr.boardFitness=dr_recursed.boardFitness;
-                    }else{
-                        // If none of the the futures lead anywhere
-                        // this branch is dead
-                        dr.valid=false;
-                    }
-                }
+    // Leaves below this node are scored against its islands
+    IslandSummary leafParent;
+    IslandSummary *leafParentPtr=nullptr;
+    if (depth+1>=targetDepth && !optDisableBoardFitness && numOrder>1){
+        summarizeIslands(initialState.getBoard(),&leafParent);
+        leafParentPtr=&leafParent;
+    }
 
-                if (dr.valid){
-                    if (!optimalResult.valid){
-                        optimalResult=dr;
-                    }
-                    // Copy result into optimal if score greatest
-                    int32_t cs_this=calculateCompositeScore(
-                        dr.scoreDelta,dr.boardFitness
-                    );
-                    int32_t cs_optimal=calculateCompositeScore(
-                        optimalResult.scoreDelta,optimalResult.boardFitness
-                    );
-                    if (cs_this>cs_optimal){
-                        //printf("Optimmal found %d X %d Y %d\n",depth,x,y);
-                        optimalResult=dr;
-                    }
-                }
+    searchFrameTop++;
+    bool anyBounded=false;
+    for (int i=0;i<numOrder;i++){
+        int x=order[i]/rangeY;
+        int y=order[i]%rangeY;
+        DFSResult dr=searchPlacement(initialState,pmt,x,y,
+            depth,targetDepth,baseScore,pq,killRequest,bounds,leafParentPtr);
+        if (dr.bounded) anyBounded=true;
+        mergeResult(&optimalResult,dr);
+    }
+    searchFrameTop--;
+    optimalResult.bounded=anyBounded;
+
+    return optimalResult;
+}
+
+// Fitness given to a sampled turn in which nothing fits. Dying costs the
+// rest of the game, so even a small chance of it should outweigh any
+// board shape.
+#define DEAD_END_FITNESS -50000
+
+// Chance node: the pieces of this turn are not dealt yet. The result is
+// the mean composite score over optChanceSamples turns drawn from the
+// pool, which is what the game deals from. Samples are seeded from the
+// position's hash, so a position always sees the same ones and its value
+// can be cached like any other.
+DFSResult searchChance(GameState initialState,int depth,int targetDepth,int32_t baseScore, PieceQueue *pq, std::atomic<bool> *killRequest, SearchBounds *bounds){
+    uint32_t step=initialState.getCurrentStepNum();
+    int32_t gainSoFar=initialState.getScore()-baseScore;
+    int n=optChanceSamples;
+    // Star1 pruning: stop once even perfect remaining samples can't lift
+    // the mean up to the incumbent
+    int64_t upper=0;
+    if (bounds!=nullptr){
+        upper=calculateCompositeScore(gainSoFar+bounds->maxGainFrom[depth],
+            maxBoardFitness(BOARD_CELLS));
+    }
+
+    uint64_t rng=hashPosition(initialState.getBoard(),pq,step,
+        targetDepth-depth,!optFixedOrder);
+    uint32_t turnEnd=(step/PIECES_PER_TURN+1)*PIECES_PER_TURN;
+    int poolSize=randSearchPG->getPoolSize();
+    int64_t sumComposite=0;
+    int64_t sumScoreDelta=0;
+    int dead=0;
+    for (int i=0;i<n;i++){
+        PieceQueue sampled=*pq;
+        for (uint32_t s=step;s<turnEnd;s++){
+            rng=mix64(rng+1);
+            sampled.setPiece(s,randSearchPG->getPoolPiece(rng%poolSize));
+        }
+        // Leaves below here are averaged, not lower bounds on the root
+        DFSResult dr=search(initialState,depth,targetDepth,baseScore,
+            &sampled,killRequest);
+        if (dr.computationInterrupted) return dr;
+        if (!dr.valid){
+            dead++;
+            dr.scoreDelta=gainSoFar;
+            dr.boardFitness=DEAD_END_FITNESS;
+        }
+        sumComposite+=calculateCompositeScore(dr.scoreDelta,dr.boardFitness);
+        sumScoreDelta+=dr.scoreDelta;
+
+        if (bounds!=nullptr){
+            int64_t incumbent=bounds->incumbent.load(std::memory_order_relaxed);
+            if (sumComposite+(n-1-i)*upper<incumbent*n){
+                threadCounters->cutoffs++;
+                DFSResult skipped=makeNullResult();
+                skipped.bounded=true;
+                return skipped;
             }
         }
     }
+    if (dead==n) return makeNullResult();
+
+    // Fitness takes the rounding remainder, so the composite score of the
+    // result is exactly the mean composite score.
+    DFSResult res=makeNullResult();
+    res.valid=true;
+    int32_t meanComposite=sumComposite/n;
+    res.scoreDelta=sumScoreDelta/n;
+    res.boardFitness=meanComposite-calculateCompositeScore(res.scoreDelta,0);
+    if (bounds!=nullptr) raiseIncumbent(bounds,meanComposite);
+    return res;
+}
+
+// Every piece left in the current turn is tried as the next one.
+// Repeated shapes are searched once, and orders that meet in the same
+// position share a transposition table entry.
+DFSResult search(GameState initialState,int depth,int targetDepth,int32_t baseScore, PieceQueue *pq, std::atomic<bool> *killRequest, Placement *hint, SearchBounds *bounds){
+
+    DFSResult nullResult=makeNullResult();
+
+    if (killRequest->load(std::memory_order_relaxed)) {
+        nullResult.computationInterrupted=true;
+        return nullResult;
+    }
+    assert (depth<targetDepth);
+
+    uint32_t step=initialState.getCurrentStepNum();
+    if (!pq->isVisible(step)){
+        return searchChance(initialState,depth,targetDepth,baseScore,
+            pq,killRequest,bounds);
+    }
+
+    DFSResult optimalResult=nullResult;
+    bool anyBounded=false;
+    uint32_t end=placeableEnd(pq,step);
+    for (uint32_t i=step;i<end;i++){
+        if (isRepeatedPiece(pq,step,i)) continue;
+        PieceQueue *piecePQ=pq;
+        PieceQueue reordered;
+        if (i!=step){
+            reordered=*pq;
+            reordered.bringForward(i,step);
+            piecePQ=&reordered;
+        }
+        DFSResult dr=searchPiece(initialState,depth,targetDepth,baseScore,
+            piecePQ,killRequest,hint,bounds);
+        dr.slot=i-step;
+        if (dr.bounded) anyBounded=true;
+        mergeResult(&optimalResult,dr);
+    }
+    optimalResult.bounded=anyBounded;
 
     return optimalResult;
 }
 
+// A root placement: piece slot (counted from the current step) and anchor
+struct RootMove{
+    uint8_t slot;
+    uint8_t x;
+    uint8_t y;
+};
+typedef struct RootMove RootMove;
+#define MAX_ROOT_MOVES (PIECES_PER_TURN*BOARD_SIZE*BOARD_SIZE)
+
 struct SearchResult{
     Placement optimalPlacement;
     int searchDepth;
@@ -324,41 +902,295 @@ struct SearchRequest{
     PieceQueue pq;
     GameState gs;
     int depth;
-    bool started;
-    bool finished;
+    std::atomic<bool> started;
+    // Stored with release once result is written; load with acquire.
+    std::atomic<bool> finished;
     DFSResult result;
+    // Root placement from a shallower depth, tried first
+    bool hasHint;
+    Placement hint;
+    // Worker time spent on this request, summed over subtasks
+    std::atomic<int64_t> elapsedUs;
+    // Nodes searched, summed over subtasks
+    std::atomic<uint64_t> nodes;
+    // Start from the shared frontier instead of the root
+    bool fromFrontier;
+    bool pruning;
+    SearchBounds bounds;
+
+    // Deep requests are split at the root: each root placement is a
+    // subtask that any worker may claim. Whoever finishes the last one
+    // merges rootResults and publishes the result. rootOrder maps
+    // subtasks to turnRootMoves indices, so the hint goes first.
+    bool split;
+    int numRootMoves;
+    std::atomic<int> nextRootMove;
+    std::atomic<int> pendingRootMoves;
+    uint8_t rootOrder[MAX_ROOT_MOVES];
+    DFSResult rootResults[MAX_ROOT_MOVES];
 };
 typedef SearchRequest SearchRequest;
 
+// Only guards the worker pool handoff below. Work claiming, progress
+// counters and result publication are lock-free.
 std::mutex threadMtx;
-bool threadKillRequest;
+std::atomic<bool> threadKillRequest;
 std::thread *workerThreads;
 
-SearchRequest *threadData;
-int nextWorkIdx;
-int workCount;
-int doneCount;
-
-int *fordisp_completecount;
-int *fordisp_workcount;
-int *fordisp_inprogcount;
+// Worker pool. Threads are created once and park on workCV whenever the
+// queue is empty. searchHL appends SearchRequests while turnActive is set
+// and waits on idleCV for workers to finish or run dry.
+std::condition_variable workCV;
+std::condition_variable idleCV;
+bool turnActive=false;
+int busyWorkers=0;
+bool poolShutdown=false;
 
+SearchRequest *threadData;
+std::atomic<int> nextWorkIdx;
+// Stored with release after the new requests are written
+std::atomic<int> workCount;
+std::atomic<int> doneCount;
+
+std::atomic<int> *fordisp_completecount;
+// Requests queued so far per depth
+std::atomic<int> *fordisp_workcount;
+// Requests each depth may get: 1, or optRandsearchMax random samples
+int *depthMaxSamples;
+std::atomic<int> *fordisp_inprogcount;
+
+// One per worker, see SearchCounters
+SearchCounters *workerCounters;
+// Counters at the start of the last search, to report its share
+SearchCounters *searchStartCounters;
+// When the last search started, and how long it ran
+std::chrono::steady_clock::time_point searchStartTime;
+int64_t searchWallUs;
+// Per depth, microseconds from the start of the search until its first
+// request finished and until all of them did. -1 until then. A sampled
+// depth can get more samples until its vote is decided, so it is only
+// done once the scheduler takes it (see markDepthDone).
+std::atomic<int64_t> *depthFirstUs;
+std::atomic<int64_t> *depthDoneUs;
+// When the depth's latest request so far finished
+std::atomic<int64_t> *depthLastUs;
+
+void workerLoop(int idx);
 void allocateArrays(){
     workerThreads=new std::thread[optNumThreads];
     threadData=new SearchRequest[optMaxSearchDepth*optRandsearchMax];
-    fordisp_completecount=new int[optMaxSearchDepth];
-    fordisp_workcount=new int[optMaxSearchDepth];
-    fordisp_inprogcount=new int[optMaxSearchDepth];
+    fordisp_completecount=new std::atomic<int>[optMaxSearchDepth];
+    fordisp_workcount=new std::atomic<int>[optMaxSearchDepth];
+    depthMaxSamples=new int[optMaxSearchDepth];
+    fordisp_inprogcount=new std::atomic<int>[optMaxSearchDepth];
+    workerCounters=new SearchCounters[optNumThreads]();
+    searchStartCounters=new SearchCounters[optNumThreads]();
+    depthFirstUs=new std::atomic<int64_t>[optMaxSearchDepth];
+    depthDoneUs=new std::atomic<int64_t>[optMaxSearchDepth];
+    depthLastUs=new std::atomic<int64_t>[optMaxSearchDepth];
+    if (optTTSizeMB>0) transpositionTable=new TranspositionTable(optTTSizeMB);
+    for(int i=0;i<optNumThreads;i++){
+        workerThreads[i]=std::thread(workerLoop,i);
+    }
+}
+void shutdownWorkerPool(){
+    {
+        std::lock_guard<std::mutex> lk(threadMtx);
+        poolShutdown=true;
+    }
+    workCV.notify_all();
+    for(int i=0;i<optNumThreads;i++){
+        workerThreads[i].join();
+    }
+}
+
+bool workAvailable(){
+    return nextWorkIdx.load()<workCount.load(std::memory_order_acquire);
 }
 
 void threadFunc();
-PieceGenerator *randSearchPG;
+
+// The position being searched this turn
+GameState turnGS;
+PieceQueue turnPQ;
+// Root placements of every distinct piece that can go next, in the
+// plain search order
+RootMove turnRootMoves[MAX_ROOT_MOVES];
+int turnNumRootMoves;
+// Number of steps from the root whose pieces are known
+int turnKnownDepth;
+// Root moves that fit on the board
+int turnNumLegalRootMoves;
+
+// In randsearch mode every sample of a turn shares its known pieces, so
+// those plies are expanded once into a frontier: each distinct board
+// after them, with the best prefix score that reaches it and the root
+// move it came from. Samples then only search their random suffix from
+// each frontier board.
+struct FrontierEntry{
+    Board board;
+    int32_t prefixGain;
+    uint16_t rootMove; // index into turnRootMoves
+};
+typedef struct FrontierEntry FrontierEntry;
+// Sorted by prefixGain, best first. Empty until a depth needs it.
+std::vector<FrontierEntry> turnFrontier;
+bool turnFrontierBuilt;
+
+extern std::atomic<uint64_t> searchDeadline;
+// The frontier is built on the scheduler thread before any worker can
+// start on it, so it gives up once the search is out of time.
+bool frontierOutOfTime(){
+    return threadKillRequest.load(std::memory_order_relaxed) ||
+        timeSinceEpochMillisec()>=searchDeadline.load();
+}
+
+// Returns false if the search ran out of time first.
+bool expandFrontier(GameState gs, int depth, PieceQueue *pq, int32_t baseScore, uint16_t rootMove){
+    if (depth==turnKnownDepth){
+        FrontierEntry fe;
+        fe.board=gs.getBoard();
+        fe.prefixGain=gs.getScore()-baseScore;
+        fe.rootMove=rootMove;
+        turnFrontier.push_back(fe);
+        return true;
+    }
+    if (frontierOutOfTime()) return false;
+    uint32_t step=gs.getCurrentStepNum();
+    for (uint32_t i=step;i<placeableEnd(pq,step);i++){
+        if (isRepeatedPiece(pq,step,i)) continue;
+        PieceQueue reordered=*pq;
+        reordered.bringForward(i,step);
+        PlacementMaskTable localTable;
+        PlacementMaskTable *pmt=getPlacementMaskTable(reordered.getPiece(step),&localTable);
+        for (int x=0;x<BOARD_SIZE-pmt->bbox.x;x++){
+            for (int y=0;y<BOARD_SIZE-pmt->bbox.y;y++){
+                Placement pl;
+                pl.piece=pmt->piece;
+                pl.x=x;
+                pl.y=y;
+                GameState next=gs;
+                if (!next.applyPlacement(pl,pmt).success) continue;
+                if (!expandFrontier(next,depth+1,&reordered,baseScore,rootMove)) return false;
+            }
+        }
+    }
+    return true;
+}
+// Returns false, leaving the frontier empty and unbuilt, if the search
+// ran out of time first.
+bool buildFrontier(){
+    turnFrontier.clear();
+    uint32_t step=turnGS.getCurrentStepNum();
+    for (int i=0;i<turnNumRootMoves;i++){
+        RootMove rm=turnRootMoves[i];
+        PieceQueue pq=turnPQ;
+        pq.bringForward(step+rm.slot,step);
+        PlacementMaskTable localTable;
+        PlacementMaskTable *pmt=getPlacementMaskTable(pq.getPiece(step),&localTable);
+        Placement pl;
+        pl.piece=pmt->piece;
+        pl.x=rm.x;
+        pl.y=rm.y;
+        GameState next=turnGS;
+        if (!next.applyPlacement(pl,pmt).success) continue;
+        if (!expandFrontier(next,1,&pq,turnGS.getScore(),i)){
+            turnFrontier.clear();
+            return false;
+        }
+    }
+
+    // One entry per board: the best prefix, earliest root move on ties.
+    // The suffix only depends on the board, so the rest can never win.
+    std::sort(turnFrontier.begin(),turnFrontier.end(),[](FrontierEntry a, FrontierEntry b){
+        if (a.board.getBits()!=b.board.getBits()) return a.board.getBits()<b.board.getBits();
+        if (a.prefixGain!=b.prefixGain) return a.prefixGain>b.prefixGain;
+        return a.rootMove<b.rootMove;
+    });
+    auto last=std::unique(turnFrontier.begin(),turnFrontier.end(),[](FrontierEntry a, FrontierEntry b){
+        return a.board==b.board;
+    });
+    turnFrontier.erase(last,turnFrontier.end());
+    std::sort(turnFrontier.begin(),turnFrontier.end(),[](FrontierEntry a, FrontierEntry b){
+        if (a.prefixGain!=b.prefixGain) return a.prefixGain>b.prefixGain;
+        return a.rootMove<b.rootMove;
+    });
+    turnFrontierBuilt=true;
+    return true;
+}
+
+// Search one random sample from every frontier board. Same result as
+// search() from the root, up to ties between equal scores.
+DFSResult searchFrontier(SearchRequest &srq, PieceQueue *pq){
+    uint32_t step=srq.gs.getCurrentStepNum();
+    SearchBounds *bounds=srq.pruning?&srq.bounds:nullptr;
+    DFSResult optimalResult=makeNullResult();
+    bool anyBounded=false;
+    for (size_t i=0;i<turnFrontier.size();i++){
+        FrontierEntry fe=turnFrontier[i];
+        if (bounds!=nullptr){
+            // Sorted by prefix score, so nothing after this can do better
+            int32_t ub=calculateCompositeScore(
+                fe.prefixGain+bounds->maxGainFrom[turnKnownDepth],
+                maxBoardFitness(BOARD_CELLS));
+            if (ub<bounds->incumbent.load(std::memory_order_relaxed)){
+                threadCounters->cutoffs++;
+                anyBounded=true;
+                break;
+            }
+        }
+        GameState gs=srq.gs;
+        gs.setBoard(fe.board);
+        for (int d=0;d<turnKnownDepth;d++) gs.incrementPieceQueue();
+        // Scores stay relative to the root by moving the base instead
+        DFSResult dr=search(gs,turnKnownDepth,srq.depth,
+            srq.gs.getScore()-fe.prefixGain,pq,&threadKillRequest,
+            nullptr,bounds);
+        if (dr.computationInterrupted) return dr;
+        if (dr.bounded) anyBounded=true;
+        if (!dr.valid) continue;
+        RootMove rm=turnRootMoves[fe.rootMove];
+        dr.bestPlacement.piece=pq->getPiece(step+rm.slot);
+        dr.bestPlacement.x=rm.x;
+        dr.bestPlacement.y=rm.y;
+        dr.slot=rm.slot;
+        mergeResult(&optimalResult,dr);
+    }
+    optimalResult.bounded=anyBounded;
+    return optimalResult;
+}
+
 void initializeThreadData(GameState gs,PieceQueue *pq){
     threadKillRequest=false;
     nextWorkIdx=0;
     workCount=0;
     doneCount=0;
+    turnGS=gs;
+    turnPQ=*pq;
     uint32_t currentStep=gs.getCurrentStepNum();
+    turnKnownDepth=0;
+    while (turnKnownDepth<optMaxSearchDepth && pq->isVisible(currentStep+turnKnownDepth)){
+        turnKnownDepth++;
+    }
+    turnFrontier.clear();
+    turnFrontierBuilt=false;
+    turnNumRootMoves=0;
+    turnNumLegalRootMoves=0;
+    for (uint32_t i=currentStep;i<placeableEnd(pq,currentStep);i++){
+        if (isRepeatedPiece(pq,currentStep,i)) continue;
+        PlacementMaskTable localTable;
+        PlacementMaskTable *rootTable=getPlacementMaskTable(
+            pq->getPiece(i),&localTable);
+        for (int x=0;x<BOARD_SIZE-rootTable->bbox.x;x++){
+            for (int y=0;y<BOARD_SIZE-rootTable->bbox.y;y++){
+                RootMove &rm=turnRootMoves[turnNumRootMoves++];
+                rm.slot=i-currentStep;
+                rm.x=x;
+                rm.y=y;
+            }
+        }
+        turnNumLegalRootMoves+=legalAnchors(gs.getBoard(),rootTable).countCells();
+    }
 /*
     printf("\nITD PQ:\n");
     printf("CSN %d\n",gs.getCurrentStepNum());
@@ -368,116 +1200,591 @@ void initializeThreadData(GameState gs,PieceQueue *pq){
         int iters=1;
         for(int i=0;i<di;i++){
             if (!pq->isVisible(currentStep+i)) {
-                iters=optRandsearchMax;
+                // Expectimax covers every sample in one request
+                iters=(optChanceSamples>0)?1:optRandsearchMax;
                 break;
             }
         }
 
-        fordisp_workcount[di]=iters;
+        depthMaxSamples[di]=iters;
+        fordisp_workcount[di]=0;
         fordisp_completecount[di]=0;
         fordisp_inprogcount[di]=0;
+        depthFirstUs[di]=-1;
+        depthDoneUs[di]=-1;
+        depthLastUs[di]=-1;
+    }
 
+    // The workers are parked, so their counters can be read
+    for (int i=0;i<optNumThreads;i++) searchStartCounters[i]=workerCounters[i];
+    searchStartTime=std::chrono::steady_clock::now();
+}
 
-        for(int ri=0;ri<iters;ri++){
-            SearchRequest srq;
-            srq.pq=(*pq);
-/*
-            printf("SRQ ri %d LOOPSTART \n",
-                    ri);
-            printf("PQ\n");
-            drawPieceQueue(pq,currentStep,5,5);
-            printf("SRQ.PQ\n");
-            drawPieceQueue(&srq.pq,currentStep,5,5);*/
-
-            for (int i=0;i<di;i++){
-                /*
-                printf("SRQ PQ i %d di %d CS %d Vis%d \n",
-                       i,di,currentStep,
-                       srq.pq.isVisible(currentStep+i));
-                drawPieceQueue(&srq.pq,currentStep,5,5);*/
-
-                if (!srq.pq.isVisible(currentStep+i)){
-                    srq.pq.setPiece(
-                        currentStep+i,
-                        randSearchPG->generate());
-                }
+// Seed of the game being played
+uint32_t gameSeed;
+
+// Deals sample ri of the pieces in [from,end) that aren't known yet.
+// Each piece is a hash of the game seed, the turn, ri and its step, so
+// samples never touch rand() and come out the same whichever thread or
+// order they are dealt in. Sample ri of a deeper depth extends sample ri
+// of the depth before.
+void dealSample(PieceQueue *pq, uint32_t from, uint32_t end, int ri){
+    uint64_t stream=mix64(mix64(((uint64_t)gameSeed<<32)|turnGS.getCurrentStepNum())+ri);
+    int poolSize=randSearchPG->getPoolSize();
+    for (uint32_t s=from;s<end;s++){
+        if (pq->isVisible(s)) continue;
+        pq->setPiece(s,randSearchPG->getPoolPiece(mix64(stream+s)%poolSize));
+    }
+}
 
+// Append count more requests of depth di to the queue. Workers may
+// already be running the shallower ones, or earlier samples of di.
+void enqueueDepth(int di, SearchResult *hint, int count){
+    uint32_t currentStep=turnGS.getCurrentStepNum();
+    int firstSample=fordisp_workcount[di];
+    int iters=count;
+    int base=workCount.load(std::memory_order_relaxed);
+    int hintIdx=-1;
+    if (hint->isValid){
+        for (int i=0;i<turnNumRootMoves;i++){
+            RootMove rm=turnRootMoves[i];
+            if (turnPQ.getPiece(currentStep+rm.slot).equal(hint->optimalPlacement.piece) &&
+                rm.x==hint->optimalPlacement.x && rm.y==hint->optimalPlacement.y){
+                hintIdx=i;
+                break;
             }
-            srq.gs=gs;
-            srq.started=false;
-            srq.finished=false;
-            srq.depth=di;
-            /*
-            printf("Queueing: depth %d ri %d\n",
-                   srq.depth,ri);*/
+        }
+    }
+    // Deal whole turns, so the last ply can pick from all of its turn's pieces
+    uint32_t fillEnd=currentStep+di;
+    if (!optFixedOrder){
+        fillEnd=((fillEnd-1)/PIECES_PER_TURN+1)*PIECES_PER_TURN;
+    }
+    // Expectimax deals unknown turns itself, at chance nodes
+    if (optChanceSamples>0) fillEnd=currentStep;
+    bool fromFrontier=(optChanceSamples==0) && !optDisableSharedPrefix &&
+        (di>turnKnownDepth);
+    // Without a frontier, the requests still search from the root. They
+    // only get queued this late to be cancelled along with the search.
+    if (fromFrontier && !turnFrontierBuilt && !buildFrontier()) fromFrontier=false;
+
+    for(int ri=0;ri<iters;ri++){
+        SearchRequest &srq=threadData[base+ri];
+        srq.pq=turnPQ;
+
+        dealSample(&srq.pq,currentStep,fillEnd,firstSample+ri);
+        srq.gs=turnGS;
+        srq.started=false;
+        srq.finished=false;
+        srq.depth=di;
+        srq.hasHint=hint->isValid;
+        srq.hint=hint->optimalPlacement;
+        srq.elapsedUs=0;
+        srq.nodes=0;
+        // The line-clear bound assumes the root has no full lines left
+        // over, which only a board overridden by the server could have.
+        srq.pruning=!optDisablePruning && countFullLines(turnGS.getBoard())==0;
+        if (srq.pruning) initSearchBounds(&srq.bounds,&srq.pq,currentStep,di);
+        srq.fromFrontier=fromFrontier;
+        // Samples already keep the workers busy
+        srq.split=!fromFrontier && (optSplitDepth>0) && (di>=optSplitDepth);
+        srq.numRootMoves=turnNumRootMoves;
+        srq.nextRootMove=0;
+        srq.pendingRootMoves=turnNumRootMoves;
+        int n=0;
+        if (hintIdx>=0) srq.rootOrder[n++]=hintIdx;
+        for (int i=0;i<turnNumRootMoves;i++){
+            if (i!=hintIdx) srq.rootOrder[n++]=i;
+        }
+        /*
+        printf("Queueing: depth %d ri %d\n",
+               srq.depth,ri);*/
+    }
+
+    fordisp_workcount[di].fetch_add(iters,std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> lk(threadMtx);
+        workCount.store(base+iters,std::memory_order_release);
+    }
+    workCV.notify_all();
+}
 
-            threadData[workCount]=srq;
-            workCount++;
+int64_t microsSince(std::chrono::steady_clock::time_point start){
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now()-start).count();
+}
+void noteRequestFinished(int depth){
+    int64_t t=microsSince(searchStartTime);
+    int64_t unset=-1;
+    depthFirstUs[depth].compare_exchange_strong(unset,t,std::memory_order_relaxed);
+    int64_t last=depthLastUs[depth].load(std::memory_order_relaxed);
+    while (t>last && !depthLastUs[depth].compare_exchange_weak(last,t,std::memory_order_relaxed));
+    fordisp_completecount[depth].fetch_add(1,std::memory_order_relaxed);
+}
+// The depth will get no more requests and all of them have finished
+void markDepthDone(int depth){
+    int64_t unset=-1;
+    depthDoneUs[depth].compare_exchange_strong(unset,
+        depthLastUs[depth].load(std::memory_order_relaxed),std::memory_order_relaxed);
+}
+void runRequest(SearchRequest &srq){
+    auto startTime=std::chrono::steady_clock::now();
+    uint64_t startNodes=threadCounters->nodes;
+    GameState gs=srq.gs;
+    int depth=srq.depth;
+    PieceQueue pq=srq.pq;
+    fordisp_inprogcount[depth].fetch_add(1,std::memory_order_relaxed);
+    srq.started.store(true,std::memory_order_relaxed);
+
+    DFSResult dfsr;
+    if (srq.fromFrontier){
+        dfsr=searchFrontier(srq,&pq);
+    }else{
+        dfsr=search(gs,
+                    0,
+                    depth,
+                    gs.getScore(),
+                    &pq,
+                    &threadKillRequest,
+                    srq.hasHint?&srq.hint:nullptr,
+                    srq.pruning?&srq.bounds:nullptr);
+    }
+
+    int64_t elapsedUs=microsSince(startTime);
+    srq.elapsedUs.fetch_add(elapsedUs,std::memory_order_relaxed);
+    srq.nodes.fetch_add(threadCounters->nodes-startNodes,std::memory_order_relaxed);
+    threadCounters->busyUs+=elapsedUs;
+    // If the flag is still clear now, no node of this search saw it set.
+    if (!threadKillRequest.load()){
+        assert (!dfsr.computationInterrupted);
+        srq.result=dfsr;
+        srq.finished.store(true,std::memory_order_release);
+        noteRequestFinished(depth);
+        doneCount.fetch_add(1,std::memory_order_relaxed);
+    }
+    fordisp_inprogcount[depth].fetch_sub(1,std::memory_order_relaxed);
+}
+void runRootMove(SearchRequest &srq, int subtaskIdx){
+    auto startTime=std::chrono::steady_clock::now();
+    uint64_t startNodes=threadCounters->nodes;
+    GameState gs=srq.gs;
+    int depth=srq.depth;
+    PieceQueue pq=srq.pq;
+    fordisp_inprogcount[depth].fetch_add(1,std::memory_order_relaxed);
+    srq.started.store(true,std::memory_order_relaxed);
+
+    int moveIdx=srq.rootOrder[subtaskIdx];
+    RootMove rm=turnRootMoves[moveIdx];
+    uint32_t step=gs.getCurrentStepNum();
+    pq.bringForward(step+rm.slot,step);
+    PlacementMaskTable localTable;
+    PlacementMaskTable *pmt=getPlacementMaskTable(pq.getPiece(step),&localTable);
+    DFSResult dr=searchPlacement(gs,pmt,rm.x,rm.y,
+        0,depth,gs.getScore(),&pq,&threadKillRequest,
+        srq.pruning?&srq.bounds:nullptr);
+    dr.slot=rm.slot;
+    srq.rootResults[moveIdx]=dr;
+    int64_t elapsedUs=microsSince(startTime);
+    srq.elapsedUs.fetch_add(elapsedUs,std::memory_order_relaxed);
+    srq.nodes.fetch_add(threadCounters->nodes-startNodes,std::memory_order_relaxed);
+    threadCounters->busyUs+=elapsedUs;
+
+    // acq_rel so the last finisher sees every other subtask's result
+    if (srq.pendingRootMoves.fetch_sub(1,std::memory_order_acq_rel)==1){
+        if (!threadKillRequest.load()){
+            DFSResult dfsr=makeNullResult();
+            for (int i=0;i<srq.numRootMoves;i++){
+                mergeResult(&dfsr,srq.rootResults[i]);
+            }
+            srq.result=dfsr;
+            srq.finished.store(true,std::memory_order_release);
+            noteRequestFinished(depth);
+            doneCount.fetch_add(1,std::memory_order_relaxed);
         }
     }
+    fordisp_inprogcount[depth].fetch_sub(1,std::memory_order_relaxed);
 }
 void threadFunc(){
     while(1){
-        if (threadKillRequest) return;
+        if (threadKillRequest.load(std::memory_order_relaxed)) return;
 
-        threadMtx.lock();
-        if (nextWorkIdx==workCount){
-             // No work left.
-            threadMtx.unlock();
+        int thisIndex=nextWorkIdx.load();
+        if (thisIndex>=workCount.load(std::memory_order_acquire)){
+            // No work left.
             return;
         }
+        SearchRequest &srq=threadData[thisIndex];
+
+        if (!srq.split){
+            // Claim the whole request
+            if (nextWorkIdx.compare_exchange_weak(thisIndex,thisIndex+1)){
+                runRequest(srq);
+            }
+            continue;
+        }
+
+        // Split request: take one root subtask, or move past the request
+        // once all of them are handed out.
+        int subtaskIdx=srq.nextRootMove.fetch_add(1,std::memory_order_relaxed);
+        if (subtaskIdx>=srq.numRootMoves){
+            nextWorkIdx.compare_exchange_strong(thisIndex,thisIndex+1);
+            continue;
+        }
+        runRootMove(srq,subtaskIdx);
+    }
+}
+void workerLoop(int idx){
+    threadCounters=&workerCounters[idx];
+    std::unique_lock<std::mutex> lk(threadMtx);
+    while(1){
+        workCV.wait(lk,[]{
+            return poolShutdown || (turnActive && workAvailable());
+        });
+        if (poolShutdown) return;
+        busyWorkers++;
+
+        lk.unlock();
+        threadFunc();
+        lk.lock();
+
+        // Either the queue ran dry or the turn was killed
+        busyWorkers--;
+        idleCV.notify_all();
+    }
+}
+
+// Vote over the finished requests of one depth
+struct DepthTally{
+    int numEntries;
+    int numFinished;
+    int numStarted;
+    int invalids;
+    bool hasPlacement;
+    Placement placement; // most voted placement
+    int count;           // votes for it
+    int runnerUpCount;   // votes for the next most voted placement
+    int32_t bfAvg;
+    int32_t sdx100Avg;
+};
+typedef struct DepthTally DepthTally;
+
+// Piece p is one of those that can be placed this turn
+bool isPlaceableNow(Piece p){
+    uint32_t step=turnGS.getCurrentStepNum();
+    for (uint32_t i=step;i<placeableEnd(&turnPQ,step);i++){
+        if (turnPQ.getPiece(i).equal(p)) return true;
+    }
+    return false;
+}
+
+DepthTally tallyDepth(int di){
+    Placement uniquePlacements[optRandsearchMax];
+    int numUniquePlacements=0;
+    int32_t bfSums[optRandsearchMax];
+    int32_t sdx100Sums[optRandsearchMax];
+    int uniquePlacementCount[optRandsearchMax];
+    int maxCount=0;
+    int maxIdx=-1;
+
+    DepthTally tally;
+    tally.numEntries=0;
+    tally.numFinished=0;
+    tally.numStarted=0;
+    tally.invalids=0;
+    tally.count=0;
+    tally.runnerUpCount=0;
+
+    int n=workCount.load(std::memory_order_acquire);
+    for (int ri=0; ri<n;ri++){
+        SearchRequest &srq=threadData[ri];
+        /*
+        printf("RI %d SRQ %d\n",
+               ri,srq.depth);*/
+        if (srq.depth != di) continue;
+
+        tally.numEntries++;
+
+        if (srq.started) tally.numStarted++;
+
+        if (!srq.finished.load(std::memory_order_acquire)) continue;
+        DFSResult dfsr=srq.result;
+        tally.numFinished++;
+        if (dfsr.valid){
+            // sanity
+            Piece placementPiece=dfsr.bestPlacement.piece;
+            if (!isPlaceableNow(placementPiece)){
+                printf("Piece mismatch!\n");
+                drawPiece(placementPiece);
+            }
+            assert (isPlaceableNow(placementPiece));
+            assert(!dfsr.computationInterrupted);
+            assert(dfsr.boardFitness>-100000);
+            assert(dfsr.scoreDelta>-100000);
+            /*
+            printf("    DFSR[%d] X %d Y %d BF %d SD %d CI%d\n",
+                i,
+                dfsr.bestPlacement.x,
+                dfsr.bestPlacement.y,
+                dfsr.boardFitness,
+                dfsr.scoreDelta,
+                dfsr.computationInterrupted);*/
+            int duplicateOf=-1;
+            Placement p1=dfsr.bestPlacement;
+            for(int i=0;i<numUniquePlacements;i++){
+                Placement p2=uniquePlacements[i];
+                if ((p1.x==p2.x) && (p1.y==p2.y) && p1.piece.equal(p2.piece)){
+                    duplicateOf=i;
+                    break;
+                }
+            }
+            if (duplicateOf==-1){
+                uniquePlacements[numUniquePlacements]=p1;
+                uniquePlacementCount[numUniquePlacements]=0;
+                bfSums[numUniquePlacements]=0;
+                sdx100Sums[numUniquePlacements]=0;
+                duplicateOf=numUniquePlacements;
+                numUniquePlacements++;
+            }
+            uniquePlacementCount[duplicateOf]++;
+            bfSums[duplicateOf]+=dfsr.boardFitness;
+            sdx100Sums[duplicateOf]+=dfsr.scoreDelta*100;
+            if (uniquePlacementCount[duplicateOf]>maxCount){
+                maxCount=uniquePlacementCount[duplicateOf];
+                maxIdx=duplicateOf;
+            }
+        }else{
+            //printf("    DFSR[%d] invalid\n",i);
+            tally.invalids++;
+        }
+    }
 
+    for (int i=0;i<numUniquePlacements;i++){
+        if (i!=maxIdx && uniquePlacementCount[i]>tally.runnerUpCount){
+            tally.runnerUpCount=uniquePlacementCount[i];
+        }
+    }
+    tally.hasPlacement=(maxIdx!=-1);
+    if (tally.hasPlacement){
+        tally.placement=uniquePlacements[maxIdx];
+        tally.count=uniquePlacementCount[maxIdx];
+        tally.bfAvg=bfSums[maxIdx]/tally.count;
+        tally.sdx100Avg=sdx100Sums[maxIdx]/tally.count;
+    }
+    return tally;
+}
+
+// Nodes searched by every request of the last search, finished or not
+uint64_t searchNodeCount(){
+    uint64_t sum=0;
+    int n=workCount.load(std::memory_order_acquire);
+    for (int ri=0;ri<n;ri++){
+        sum+=threadData[ri].nodes.load(std::memory_order_relaxed);
+    }
+    return sum;
+}
 
-        int thisIndex=nextWorkIdx;
-        nextWorkIdx++;
-        GameState gs=threadData[thisIndex].gs;
-        int depth=threadData[thisIndex].depth;
-        PieceQueue pq=threadData[thisIndex].pq;
-        fordisp_inprogcount[depth]++;
-        threadData[thisIndex].started=true;
-        threadMtx.unlock();
+// One-sided sign test at about 99%: of the samples voting for the top
+// two placements, the top one got more than a coin flip would give it.
+#define VOTE_Z 2.326
+bool voteSeparated(int top, int runnerUp){
+    return top-runnerUp>VOTE_Z*sqrt((double)(top+runnerUp));
+}
 
-        DFSResult dfsr=search(gs,
-                              0,
-                              depth,
-                              gs.getScore(),
-                              &pq,
-                              &threadKillRequest);
+// Adaptive sampling. A random-sample depth starts with
+// optRanddearchMin samples and gets optNumThreads more at a time until
+// its vote is separated or it has optRandsearchMax. A depth whose samples
+// all found no valid move gets no more: more samples would only die the
+// same way. Returns how many to add now, 0 if none are needed, or -1
+// while samples are still out.
+int moreSamplesNeeded(int d){
+    int queued=fordisp_workcount[d];
+    if (queued>=depthMaxSamples[d]) return 0;
+    DepthTally tally=tallyDepth(d);
+    if (tally.numFinished<tally.numEntries) return -1;
+    if (!tally.hasPlacement) return 0;
+    if (voteSeparated(tally.count,tally.runnerUpCount)) return 0;
+    int more=optNumThreads;
+    if (more>depthMaxSamples[d]-queued) more=depthMaxSamples[d]-queued;
+    return more;
+}
 
-        threadMtx.lock();
-        if (!threadKillRequest){
-            assert (!dfsr.computationInterrupted);
-            threadData[thisIndex].result=dfsr;
-            threadData[thisIndex].finished=true;
-            fordisp_completecount[depth]++;
-            fordisp_inprogcount[depth]--;
-            doneCount++;
+// Predicted worker time for one request of depth di, from the deepest
+// measured depth and the branching factor between it and the one before.
+// Returns -1 if there isn't enough data yet.
+int64_t predictRequestUs(int di){
+    int64_t avg[optMaxSearchDepth];
+    int measured=0;
+    int n=workCount.load(std::memory_order_acquire);
+    for (int d=1;d<di;d++){
+        int64_t sum=0;
+        int count=0;
+        for (int ri=0;ri<n;ri++){
+            SearchRequest &srq=threadData[ri];
+            if (srq.depth!=d) continue;
+            if (!srq.finished.load(std::memory_order_acquire)) continue;
+            sum+=srq.elapsedUs.load(std::memory_order_relaxed);
+            count++;
         }
-        threadMtx.unlock();
+        avg[d]=(count>0)?(sum/count):-1;
+        if (count>0) measured=d;
     }
+    if (measured<2 || avg[measured-1]<=0) return -1;
+    double branching=(double)avg[measured]/avg[measured-1];
+    if (branching<1) branching=1;
+    double pred=avg[measured];
+    for (int d=measured;d<di;d++) pred*=branching;
+    return (int64_t)pred;
 }
-void sleepMillis(uint32_t ms){
-    usleep(ms*1000);
+
+// Set in --batch games: nothing is drawn
+bool quietGame=false;
+
+// Time management. Every turn is allotted --millisec-per-turn. Turns
+// that settle early put what they didn't use in the bank, and turns that
+// are still unsettled at their deadline draw up to one more allotment
+// from it, so the time per turn stays within the allotment on average.
+// The bank holds at most this many allotments.
+#define TIME_BANK_TURNS 4
+int64_t timeBankMs=0;
+
+// Completed depths in a row that must agree on the pick before it is
+// taken early, and the vote share the deepest of them needs
+#define SETTLED_DEPTHS 3
+#define SETTLED_AGREEMENT_PCT 90
+
+// Time manager state of one search
+struct TurnClock{
+    int64_t allottedMs;     // 0 if the search isn't managed
+    bool extended;
+    int stableDepths;       // completed depths in a row with the same pick
+    int agreementPct;       // vote share of the pick at the deepest depth
+    int invalidPct;         // samples that died at the deepest depth
+};
+typedef struct TurnClock TurnClock;
+
+bool samePlacement(Placement a, Placement b){
+    return a.x==b.x && a.y==b.y && a.piece.equal(b.piece);
 }
-SearchResult searchHL(GameState gs, PieceQueue *pq, uint64_t timelimit){
-    Piece nextPiece=pq->getPiece(gs.getCurrentStepNum());
+// A new depth completed with tally, after best held the depth before
+void clockDepthDone(TurnClock *clock, SearchResult *best, DepthTally *tally){
+    bool same=best->isValid && tally->hasPlacement &&
+        samePlacement(best->optimalPlacement,tally->placement);
+    clock->stableDepths=same?clock->stableDepths+1:1;
+    int finished=tally->numFinished>0?tally->numFinished:1;
+    clock->agreementPct=tally->hasPlacement?tally->count*100/finished:0;
+    clock->invalidPct=tally->invalids*100/finished;
+}
+// The pick can't get any better by searching on
+bool clockSettled(TurnClock *clock, SearchResult *best){
+    if (clock->allottedMs==0 || best->searchDepth==0) return false;
+    if (turnNumLegalRootMoves<=1) return true;
+    // Picks from the known pieces alone say nothing about what comes next
+    if (best->searchDepth<=turnKnownDepth) return false;
+    return clock->stableDepths>=SETTLED_DEPTHS &&
+        clock->agreementPct>=SETTLED_AGREEMENT_PCT;
+}
+// At the deadline: the pick just changed, the samples disagree, or many
+// of them die
+bool clockWantsMore(TurnClock *clock, SearchResult *best){
+    if (clock->allottedMs==0 || clock->extended) return false;
+    if (best->searchDepth==0) return true;
+    return (clock->stableDepths<2 && best->searchDepth>1) ||
+        clock->agreementPct<50 || clock->invalidPct>=25;
+}
+
+// Deadline of the running search. Read on every poll, so it can be
+// moved while the search runs (see finishPondering).
+std::atomic<uint64_t> searchDeadline;
+
+// Runs the iterative deepening loop until searchDeadline or until every
+// depth is done. Results stay in threadData for collectSearchResult.
+// quiet suppresses the progress line, for searches run in the background.
+// allottedMs>0 lets the time manager move the deadline, within the bank.
+void runIterativeDeepening(GameState gs, PieceQueue *pq, bool quiet, int64_t allottedMs=0){
     /*
     printf("SHL PQ:\n");
     printf("CSN %d\n",gs.getCurrentStepNum());
     drawPieceQueue(pq,gs.getCurrentStepNum(),5,5);*/
 
+    // Iterative deepening. Depths are queued one at a time, each once
+    // the previous one is fully handed out to workers, and only if the
+    // cost model says enough of it can finish before the deadline.
+    // bestSoFar always holds the deepest fully searched depth's pick,
+    // and seeds the move ordering of every depth queued after it.
+    SearchResult bestSoFar;
+    bestSoFar.isValid=false;
+    bestSoFar.searchDepth=0;
+    int enqueuedDepth=0;
+    bool scheduleClosed=false;
+    TurnClock clock;
+    clock.allottedMs=allottedMs;
+    clock.extended=false;
+    clock.stableDepths=0;
+    clock.agreementPct=0;
+    clock.invalidPct=0;
 
     initializeThreadData(gs,pq);
-    for(int i=0;i<optNumThreads;i++){
-        workerThreads[i]=std::thread(threadFunc);
+    if (transpositionTable!=nullptr) transpositionTable->newGeneration();
+    {
+        std::lock_guard<std::mutex> lk(threadMtx);
+        turnActive=true;
     }
 
     while(1){
         uint64_t t=timeSinceEpochMillisec();
-        printf("\rSearching");
+        uint64_t timelimit=searchDeadline.load();
+
+        // Anytime result: take each depth as soon as all of it is done.
+        // The deepest one may still be waiting on its vote, and is only
+        // done once it needs no more samples.
+        for (int d=bestSoFar.searchDepth+1;d<=enqueuedDepth;d++){
+            DepthTally tally=tallyDepth(d);
+            if (tally.numFinished<tally.numEntries) break;
+            if (d==enqueuedDepth && !scheduleClosed && moreSamplesNeeded(d)!=0) break;
+            markDepthDone(d);
+            clockDepthDone(&clock,&bestSoFar,&tally);
+            bestSoFar.searchDepth=d;
+            bestSoFar.isValid=tally.hasPlacement;
+            bestSoFar.optimalPlacement=tally.placement;
+        }
 
-        for (int d=1;d<optMaxSearchDepth;d++){
+        // Once the workers have claimed everything, either give the
+        // deepest depth more samples or queue the next one
+        int moreSamples=0;
+        if (!workAvailable() && t<timelimit && enqueuedDepth>0){
+            if (scheduleClosed){
+                // Nothing deeper fits, so the time left goes to samples
+                moreSamples=depthMaxSamples[enqueuedDepth]-fordisp_workcount[enqueuedDepth];
+                if (moreSamples>optNumThreads) moreSamples=optNumThreads;
+            }else{
+                moreSamples=moreSamplesNeeded(enqueuedDepth);
+            }
+            if (moreSamples>0) enqueueDepth(enqueuedDepth,&bestSoFar,moreSamples);
+        }
+        if (!scheduleClosed && !workAvailable() && t<timelimit && moreSamples==0){
+            int next=enqueuedDepth+1;
+            if (next>=optMaxSearchDepth){
+                scheduleClosed=true;
+            }else{
+                int samples=depthMaxSamples[next];
+                if (samples>optRanddearchMin) samples=optRanddearchMin;
+                int64_t predUs=predictRequestUs(next);
+                int64_t predWallMs=predUs*samples/optNumThreads/1000;
+                if (predUs>=0 && predWallMs>(int64_t)(timelimit-t)){
+                    // Would not finish in time, don't start it
+                    scheduleClosed=true;
+                }else{
+                    enqueueDepth(next,&bestSoFar,samples);
+                    enqueuedDepth=next;
+                }
+            }
+        }
+
+        if (!quiet) printf("\rSearching");
+
+        for (int d=1;d<optMaxSearchDepth && !quiet;d++){
             int total=fordisp_workcount[d];
+            if (total==0) total=depthMaxSamples[d];
             int complete=fordisp_completecount[d];
             int inprog=fordisp_inprogcount[d];
             // Not all work is done
@@ -504,108 +1811,166 @@ SearchResult searchHL(GameState gs, PieceQueue *pq, uint64_t timelimit){
         }
         printf("        ");*/
 
+        if (clockSettled(&clock,&bestSoFar)){
+            std::lock_guard<std::mutex> lk(threadMtx);
+            threadKillRequest=true;
+            turnActive=false;
+            if (!quiet) printf("<- Settled\n");
+            break;
+        }
+        if (t>=timelimit && clockWantsMore(&clock,&bestSoFar) && timeBankMs>0){
+            int64_t extraMs=timeBankMs<allottedMs?timeBankMs:allottedMs;
+            timelimit+=extraMs;
+            searchDeadline=timelimit;
+            clock.extended=true;
+        }
         if (t<timelimit){
-            printf("%5d ms",(int)(timelimit-t));
-            fflush(stdout);
+            if (!quiet){
+                printf("%5d ms",(int)(timelimit-t));
+                fflush(stdout);
+            }
         }else{
+            std::lock_guard<std::mutex> lk(threadMtx);
             threadKillRequest=true;
-            printf("<-  Timeout\n");
+            turnActive=false;
+            if (!quiet) printf(clock.extended?"<-  Timeout (extended)\n":"<-  Timeout\n");
             break;
         }
-        if (doneCount==workCount){
-            printf("<- Work done\n");
+        bool samplesLeft=enqueuedDepth>0 &&
+            fordisp_workcount[enqueuedDepth]<depthMaxSamples[enqueuedDepth];
+        if (scheduleClosed && doneCount==workCount && !samplesLeft){
+            std::lock_guard<std::mutex> lk(threadMtx);
+            turnActive=false;
+            if (!quiet) printf("<- Work done\n");
             break;
         }
-        sleepMillis(30);
+        // Wake up early if the workers go idle, a request finishes once
+        // the queue has run dry, or the next depth can be queued. While
+        // the deepest depth's samples are still out (moreSamples==-1)
+        // there is nothing to queue until one of them finishes.
+        // Measured again, since queueing a depth (and building the
+        // frontier for it) takes time too
+        uint64_t now=timeSinceEpochMillisec();
+        if (now>=timelimit) continue;
+        uint64_t waitMs=timelimit-now;
+        if (waitMs>30) waitMs=30;
+        int doneBefore=doneCount.load(std::memory_order_relaxed);
+        bool waitingForSamples=(moreSamples==-1);
+        std::unique_lock<std::mutex> lk(threadMtx);
+        idleCV.wait_for(lk,std::chrono::milliseconds(waitMs),[&]{
+            if (workAvailable()) return false;
+            if (busyWorkers==0) return true;
+            if (doneCount.load(std::memory_order_relaxed)!=doneBefore) return true;
+            return !scheduleClosed && !waitingForSamples;
+        });
     }
 
 
     fflush(stdout);
-    for(int i=0;i<optNumThreads;i++){
-        workerThreads[i].join();
+    {
+        // Workers return to the pool once they notice the kill request
+        std::unique_lock<std::mutex> lk(threadMtx);
+        idleCV.wait(lk,[]{ return busyWorkers==0; });
+    }
+    // Nothing more gets queued now, so whatever has finished is done.
+    // This also covers samples that finished after the loop last looked.
+    for (int d=1;d<=enqueuedDepth;d++){
+        DepthTally tally=tallyDepth(d);
+        if (tally.numEntries>0 && tally.numFinished==tally.numEntries) markDepthDone(d);
     }
+    searchWallUs=microsSince(searchStartTime);
+}
 
+// --stats-out file, nullptr if not given
+FILE *statsOut=nullptr;
+
+// Prints the counters and timing of the last search, summed over the
+// workers, and appends them to statsOut.
+void reportSearchStats(uint32_t turn){
+    SearchCounters total={};
+    int64_t busyUs[optNumThreads];
+    for (int i=0;i<optNumThreads;i++){
+        SearchCounters &c=workerCounters[i];
+        SearchCounters &c0=searchStartCounters[i];
+        total.nodes+=c.nodes-c0.nodes;
+        total.placementsTried+=c.placementsTried-c0.placementsTried;
+        total.placementsFailed+=c.placementsFailed-c0.placementsFailed;
+        total.fitnessEvals+=c.fitnessEvals-c0.fitnessEvals;
+        total.fitnessCacheHits+=c.fitnessCacheHits-c0.fitnessCacheHits;
+        total.cutoffs+=c.cutoffs-c0.cutoffs;
+        total.ttHits+=c.ttHits-c0.ttHits;
+        busyUs[i]=c.busyUs-c0.busyUs;
+    }
+    int64_t wallUs=searchWallUs>0?searchWallUs:1;
+
+    ansiColorSet(WHITE_DIM);
+    printf("  Nodes %llu in %d ms (%.2f M/s) | Tried %llu Failed %llu"
+        " | Fitness %llu (%d%% cached) | Cutoffs %llu | TT hits %llu\n",
+        (unsigned long long)total.nodes,(int)(wallUs/1000),
+        total.nodes/(double)wallUs,
+        (unsigned long long)total.placementsTried,
+        (unsigned long long)total.placementsFailed,
+        (unsigned long long)total.fitnessEvals,
+        total.fitnessEvals>0?(int)(total.fitnessCacheHits*100/total.fitnessEvals):0,
+        (unsigned long long)total.cutoffs,
+        (unsigned long long)total.ttHits);
+    printf("  First/done ms per depth |");
+    for (int d=1;d<optMaxSearchDepth;d++){
+        int64_t first=depthFirstUs[d].load();
+        int64_t done=depthDoneUs[d].load();
+        if (first<0) continue;
+        if (done>=0) printf(" %d:%d/%d",d,(int)(first/1000),(int)(done/1000));
+        else printf(" %d:%d/-",d,(int)(first/1000));
+    }
+    printf("\n  Worker busy |");
+    for (int i=0;i<optNumThreads;i++) printf(" %3d%%",(int)(busyUs[i]*100/wallUs));
+    printf("\n");
+    ansiColorSet(NONE);
+
+    if (statsOut==nullptr) return;
+    fprintf(statsOut,"{\"seed\":%d,\"turn\":%u,\"wall_us\":%lld,"
+        "\"nodes\":%llu,\"placements_tried\":%llu,\"placements_failed\":%llu,"
+        "\"fitness_evals\":%llu,\"fitness_cache_hits\":%llu,"
+        "\"cutoffs\":%llu,\"tt_hits\":%llu",
+        optSeed,turn,(long long)wallUs,
+        (unsigned long long)total.nodes,
+        (unsigned long long)total.placementsTried,
+        (unsigned long long)total.placementsFailed,
+        (unsigned long long)total.fitnessEvals,
+        (unsigned long long)total.fitnessCacheHits,
+        (unsigned long long)total.cutoffs,
+        (unsigned long long)total.ttHits);
+    // Depth arrays start at depth 1, -1 where it never finished
+    fprintf(statsOut,",\"depth_first_us\":[");
+    for (int d=1;d<optMaxSearchDepth;d++){
+        fprintf(statsOut,"%s%lld",d>1?",":"",(long long)depthFirstUs[d].load());
+    }
+    fprintf(statsOut,"],\"depth_done_us\":[");
+    for (int d=1;d<optMaxSearchDepth;d++){
+        fprintf(statsOut,"%s%lld",d>1?",":"",(long long)depthDoneUs[d].load());
+    }
+    fprintf(statsOut,"],\"worker_busy_us\":[");
+    for (int i=0;i<optNumThreads;i++){
+        fprintf(statsOut,"%s%lld",i>0?",":"",(long long)busyUs[i]);
+    }
+    fprintf(statsOut,"]}\n");
+    fflush(statsOut);
+}
+
+// Tallies and prints every depth of the last search, returns the deepest
+// usable one.
+SearchResult collectSearchResult(GameState gs, PieceQueue *pq){
     SearchResult res;
     res.isValid=false;
     res.searchDepth=0;
 
     for (int di=1;di<optMaxSearchDepth;di++){
-        Placement uniquePlacements[optRandsearchMax];
-        int numUniquePlacements=0;
-        int32_t bfSums[optRandsearchMax];
-        int32_t sdx100Sums[optRandsearchMax];
-        int uniquePlacementCount[optRandsearchMax];
-        int maxCount=0;
-        int maxIdx=-1;
-        int invalids=0;
-        int numEntries=0;
-        int numFinished=0;
-        int numStarted=0;
-
-        for (int ri=0; ri<workCount;ri++){
-            SearchRequest srq=threadData[ri];
-            /*
-            printf("RI %d SRQ %d\n",
-                   ri,srq.depth);*/
-            if (srq.depth != di) continue;
-
-            numEntries++;
-
-            if (srq.started) numStarted++;
-
-            if (!srq.finished) continue;
-            DFSResult dfsr=srq.result;
-            numFinished++;
-            if (dfsr.valid){
-                // sanity
-                Piece placementPiece=dfsr.bestPlacement.piece;
-                if (!placementPiece.equal(nextPiece)){
-                    printf("Piece mismatch!\n");
-                    drawPiece(placementPiece);
-                    printf("----\n");
-                    drawPiece(nextPiece);
-                }
-                assert (placementPiece.equal(nextPiece));
-                assert(!dfsr.computationInterrupted);
-                assert(dfsr.boardFitness>-100000);
-                assert(dfsr.scoreDelta>-100000);
-                /*
-                printf("    DFSR[%d] X %d Y %d BF %d SD %d CI%d\n",
-                    i,
-                    dfsr.bestPlacement.x,
-                    dfsr.bestPlacement.y,
-                    dfsr.boardFitness,
-                    dfsr.scoreDelta,
-                    dfsr.computationInterrupted);*/
-                int duplicateOf=-1;
-                Placement p1=dfsr.bestPlacement;
-                for(int i=0;i<numUniquePlacements;i++){
-                    Placement p2=uniquePlacements[i];
-                    if ((p1.x==p2.x) && (p1.y==p2.y)){
-                        duplicateOf=i;
-                        break;
-                    }
-                }
-                if (duplicateOf==-1){
-                    uniquePlacements[numUniquePlacements]=p1;
-                    uniquePlacementCount[numUniquePlacements]=0;
-                    bfSums[numUniquePlacements]=0;
-                    sdx100Sums[numUniquePlacements]=0;
-                    duplicateOf=numUniquePlacements;
-                    numUniquePlacements++;
-                }
-                uniquePlacementCount[duplicateOf]++;
-                bfSums[duplicateOf]+=dfsr.boardFitness;
-                sdx100Sums[duplicateOf]+=dfsr.scoreDelta*100;
-                if (uniquePlacementCount[duplicateOf]>maxCount){
-                    maxCount=uniquePlacementCount[duplicateOf];
-                    maxIdx=duplicateOf;
-                }
-            }else{
-                //printf("    DFSR[%d] invalid\n",i);
-                invalids++;
-            }
-        }
+        DepthTally tally=tallyDepth(di);
+        int numEntries=tally.numEntries;
+        int numFinished=tally.numFinished;
+        int invalids=tally.invalids;
+        // Never queued
+        if (numEntries==0) continue;
 
         bool sufficientIterations=(numFinished>=numEntries) || (numFinished>=optRanddearchMin);
 
@@ -616,19 +1981,17 @@ SearchResult searchHL(GameState gs, PieceQueue *pq, uint64_t timelimit){
         if (sufficientIterations){
             printf("  Depth %2d | %2d/%2d",
                 di,numFinished,numEntries);
-            for(int i=0;i<numUniquePlacements;i++){
-                if (i!=maxIdx) continue;
-                Placement pl=uniquePlacements[i];
-                int count=uniquePlacementCount[i];
+            if (tally.hasPlacement){
+                Placement pl=tally.placement;
+                int count=tally.count;
                 int percentage=count*100/numFinished;
-                int32_t bfAvg=bfSums[i]/count;
-                int32_t sdx100Avg=sdx100Sums[i]/count;
                 printf(" | X%2d Y%2d BFavg %4d SDavg %6.2f",
                     pl.x,pl.y,
-                    bfAvg,sdx100Avg/100.0);
+                    tally.bfAvg,tally.sdx100Avg/100.0);
                 if (numEntries==1) {
                     ansiColorSet(GREEN_DIM);
-                    printf(" (Determined)");
+                    if (pq->isVisible(gs.getCurrentStepNum()+di-1)) printf(" (Determined)");
+                    else printf(" (Expectimax)");
                     ansiColorSet(NONE);
                 }else{
                     if (percentage>70) ansiColorSet(GREEN_BRIGHT);
@@ -640,10 +2003,6 @@ SearchResult searchHL(GameState gs, PieceQueue *pq, uint64_t timelimit){
                         );
                     ansiColorSet(NONE);
                 }
-                /*
-                if (uniquePlacementCount[i]==maxCount) printf(" *");
-                if (i==maxIdx) printf(" <<");
-                printf("\n");*/
             }
             if (invalids>0){
                 ansiColorSet(RED_BRIGHT);
@@ -654,16 +2013,16 @@ SearchResult searchHL(GameState gs, PieceQueue *pq, uint64_t timelimit){
             }
             printf("\n");
 
-            if (maxIdx==-1){
+            if (!tally.hasPlacement){
                 // No results
                 sr.isValid=false;
 
             }else {
                 sr.isValid=true;
-                sr.optimalPlacement=uniquePlacements[maxIdx];
+                sr.optimalPlacement=tally.placement;
             }
 
-        }else if (numStarted>0){
+        }else if (tally.numStarted>0){
             ansiColorSet(WHITE_DIM);
             printf("  Depth %2d | %2d/%2d (Insufficient)",
                 di,numFinished,numEntries);
@@ -677,6 +2036,7 @@ SearchResult searchHL(GameState gs, PieceQueue *pq, uint64_t timelimit){
         if (sr.isValid) res=sr;
 
     }
+    reportSearchStats(gs.getCurrentStepNum());
 
 
 
@@ -685,14 +2045,107 @@ SearchResult searchHL(GameState gs, PieceQueue *pq, uint64_t timelimit){
     return res;
 }
 
+SearchResult searchHL(GameState gs, PieceQueue *pq, uint64_t timelimit){
+    uint64_t startMs=timeSinceEpochMillisec();
+    int64_t allottedMs=(timelimit>startMs)?(timelimit-startMs):1;
+    searchDeadline=timelimit;
+    runIterativeDeepening(gs,pq,quietGame,optDisableTimeManager?0:allottedMs);
+    if (!optDisableTimeManager){
+        timeBankMs+=allottedMs-(int64_t)(timeSinceEpochMillisec()-startMs);
+        if (timeBankMs<0) timeBankMs=0;
+        if (timeBankMs>allottedMs*TIME_BANK_TURNS) timeBankMs=allottedMs*TIME_BANK_TURNS;
+    }
+    return collectSearchResult(gs,pq);
+}
 
+// Pondering (--server-game): while the server plays our move on the
+// phone, search the position it should answer with. That is the board
+// after our move with the rest of the current turn's pieces, so there is
+// nothing to ponder once a turn's pieces are all placed.
+std::thread ponderThread;
+bool ponderActive=false;
+uint64_t ponderStart;
+GameState ponderGS;
+PieceQueue ponderPQ;
+
+bool startPondering(GameState gs, PieceQueue *pq){
+    if (!pq->isVisible(gs.getCurrentStepNum())) return false;
+    ponderGS=gs;
+    ponderPQ=*pq;
+    ponderStart=timeSinceEpochMillisec();
+    // No real deadline until the server answers
+    searchDeadline=ponderStart+60*60*1000;
+    ponderActive=true;
+    ponderThread=std::thread([]{
+        runIterativeDeepening(ponderGS,&ponderPQ,true);
+    });
+    return true;
+}
 
-int main(int argc, char **argv){
-    parse_options(argc,argv);
+// Ends pondering once the server state is in. On a hit (same board, turn
+// and pieces in any order) the search keeps going until optMsPerTurn
+// after pondering started, or stops right away if that has passed; its
+// results are then collected with collectSearchResult. Returns false on
+// a miss, after discarding the search.
+bool finishPondering(Board board, uint32_t turnIndex, Piece *servPieces){
+    if (!ponderActive) return false;
+
+    uint32_t step=ponderGS.getCurrentStepNum();
+    uint32_t end=ponderPQ.turnEnd(step);
+    bool hit=board.equal(ponderGS.getBoard()) && turnIndex==step;
+    bool used[3]={false,false,false};
+    int numServ=0;
+    for (int j=0;j<3;j++) if (servPieces[j].numBlocks()>0) numServ++;
+    if (numServ!=(int)(end-step)) hit=false;
+    for (uint32_t i=step;i<end && hit;i++){
+        bool found=false;
+        for (int j=0;j<3;j++){
+            if (used[j] || servPieces[j].numBlocks()==0) continue;
+            if (servPieces[j].equal(ponderPQ.getPiece(i))){
+                used[j]=true;
+                found=true;
+                break;
+            }
+        }
+        if (!found) hit=false;
+    }
+
+    uint64_t t=timeSinceEpochMillisec();
+    uint64_t deadline=ponderStart+optMsPerTurn;
+    if (!hit || deadline<t) deadline=t;
+    searchDeadline=deadline;
+    ponderThread.join();
+    ponderActive=false;
+
+    if (hit) printf("Ponder hit, pondered %d ms\n",(int)(t-ponderStart));
+    else printf("Ponder miss\n");
+    return hit;
+}
+
+
+
+// Totals of one game, for --batch
+struct GameStats{
+    int turns;
+    int score;
+    uint64_t nodes;
+    uint64_t searchMs;
+    uint64_t maxTurnMs;
+};
+typedef struct GameStats GameStats;
+
+int playGame(GameStats *stats){
     allocateArrays();
+    if (optStatsOut!=nullptr){
+        statsOut=fopen(optStatsOut,"a");
+        if (statsOut==nullptr){
+            perror(optStatsOut);
+            return -1;
+        }
+    }
 
-    if (optSeed) srand(optSeed);
-    else srand(time(nullptr));
+    gameSeed=optSeed?optSeed:time(nullptr);
+    srand(gameSeed);
     /*
     Board tb1,tb2;
     for (int x=0;x<BOARD_SIZE;x++){
@@ -736,12 +2189,17 @@ int main(int argc, char **argv){
     PieceGenerator *pgen=readPieceDef("piecedefs.txt");
     if (optPrintPieces) pgen->debugPrint();
     randSearchPG=pgen;
+    initPlacementTables(pgen);
     Board lastBoard;
     GameState gs;
+    stats->nodes=0;
+    stats->searchMs=0;
+    stats->maxTurnMs=0;
     while (1){
 
 
         uint32_t turnIndex=gs.getCurrentStepNum();
+        bool ponderHit=false;
 
         if (!optServerGame){
 
@@ -772,6 +2230,7 @@ int main(int argc, char **argv){
             while (!wc->recvServerStateUpdate(&ss)){
                 // wait for server
                 printf("\rwait for server");
+                if (ponderActive) printf(" (pondering)");
                 waitN=(waitN+1)%10;
                 for (int i=0;i<10;i++){
                     if (i<waitN) printf(".");
@@ -790,6 +2249,18 @@ int main(int argc, char **argv){
                 }
             }
 
+            Piece servPieces[3];
+            for (int x=0;x<5;x++){
+                for (int y=0;y<5;y++){
+                    int idx=x+y*5;
+                    for (int pidx=0;pidx<3;pidx++){
+                        if (ss.pieces[pidx][idx]) servPieces[pidx].addBlock(x,y);
+                    }
+                }
+            }
+
+            ponderHit=finishPondering(serverBoard,ss.turnIndex,servPieces);
+
             if (!serverBoard.equal(gs.getBoard())){
                 ansiColorSet(RED);
                 printf("Board mismatch\n");
@@ -814,17 +2285,6 @@ int main(int argc, char **argv){
             }
 
 
-            Piece servPieces[3];
-            for (int x=0;x<5;x++){
-                for (int y=0;y<5;y++){
-                    int idx=x+y*5;
-                    for (int pidx=0;pidx<3;pidx++){
-                        if (ss.pieces[pidx][idx]) servPieces[pidx].addBlock(x,y);
-                    }
-                }
-            }
-
-
 
             for (int i=0;i<3;i++){
                 if (servPieces[i].numBlocks()>0){
@@ -843,9 +2303,25 @@ int main(int argc, char **argv){
         ansiColorSet(NONE);
 
         SearchResult sr;
-        sr=searchHL(gs,&pq,timeSinceEpochMillisec()+optMsPerTurn);
+        uint64_t searchStart=timeSinceEpochMillisec();
+        if (ponderHit) sr=collectSearchResult(gs,&pq);
+        else sr=searchHL(gs,&pq,timeSinceEpochMillisec()+optMsPerTurn);
+        uint64_t turnMs=timeSinceEpochMillisec()-searchStart;
+        stats->nodes+=searchNodeCount();
+        stats->searchMs+=turnMs;
+        if (turnMs>stats->maxTurnMs) stats->maxTurnMs=turnMs;
         printf("Taking result from depth %d\n",sr.searchDepth);
-        drawPieceQueue(&pq,gs.getCurrentStepNum(),optPreviewPieces,sr.searchDepth);
+        if (sr.isValid){
+            // The search may pick any piece of this turn, move it up front
+            uint32_t step=gs.getCurrentStepNum();
+            for (uint32_t i=step;i<placeableEnd(&pq,step);i++){
+                if (pq.getPiece(i).equal(sr.optimalPlacement.piece)){
+                    pq.bringForward(i,step);
+                    break;
+                }
+            }
+        }
+        if (!quietGame) drawPieceQueue(&pq,gs.getCurrentStepNum(),optPreviewPieces,sr.searchDepth);
 
         PlacementResult pr;
         Placement placement;
@@ -868,10 +2344,10 @@ int main(int argc, char **argv){
         gs.applyPlacement(placement);
         printf("Step %d \n",gs.getCurrentStepNum());
         printf("Score: %d (+%d)\n",gs.getScore(),pr.scoreDelta);
-        drawBoardFancy(lastBoard,pr.preClear,pr.finalResult);
+        if (!quietGame) drawBoardFancy(lastBoard,pr.preClear,pr.finalResult);
 
         lastBoard=pr.finalResult;
-        if (!optDisableBoardFitness){
+        if (!optDisableBoardFitness && !quietGame){
             ansiColorSet(WHITE_DIM);
             printf("islandnessP %d\n",
                 calculateIslandness(pr.finalResult));
@@ -897,11 +2373,347 @@ int main(int argc, char **argv){
             cm.y=placement.y;
             wc->sendMove(turnIndex,&cm);
             printf("-> Sent!\n");
+
+            if (!optDisablePonder) startPondering(gs,&pq);
         }
         //printf("Enter to coninue...\n");
     }
 
+    shutdownWorkerPool();
     printf("Ending game.\n");
+    stats->turns=gs.getCurrentStepNum();
+    stats->score=gs.getScore();
 
     return 0;
 }
+
+// --batch: play optBatch games, optBatchJobs at a time. The engine state
+// is all global, so each game runs in its own process with its own seed
+// and sends its GameStats back through a pipe.
+int runBatch(){
+    if (optServerGame){
+        printf("--batch can't be used with --server-game\n");
+        return -1;
+    }
+    int jobs=optBatchJobs;
+    if (jobs<=0){
+        jobs=std::thread::hardware_concurrency()/optNumThreads;
+        if (jobs<1) jobs=1;
+    }
+    FILE *out=fopen(optBatchOut,"w");
+    if (out==nullptr){
+        perror(optBatchOut);
+        return -1;
+    }
+    fprintf(out,"game,seed,turns,score,nodes,search_ms,avg_ms_per_turn,max_ms_per_turn\n");
+    fflush(out);
+
+    int baseSeed=optSeed?optSeed:time(nullptr);
+    pid_t pids[jobs];
+    int fds[jobs];
+    int games[jobs];
+    for (int i=0;i<jobs;i++) pids[i]=0;
+
+    printf("Playing %d games, %d at a time\n",optBatch,jobs);
+    fflush(stdout);
+    uint64_t startMs=timeSinceEpochMillisec();
+    int started=0;
+    int finished=0;
+    while (finished<optBatch){
+        for (int i=0;i<jobs && started<optBatch;i++){
+            if (pids[i]!=0) continue;
+            int pfd[2];
+            if (pipe(pfd)!=0){
+                perror("pipe");
+                return -1;
+            }
+            int seed=baseSeed+started;
+            pid_t pid=fork();
+            if (pid==0){
+                close(pfd[0]);
+                if (freopen("/dev/null","w",stdout)==nullptr) _exit(-1);
+                optSeed=seed;
+                quietGame=true;
+                GameStats gst;
+                playGame(&gst);
+                if (write(pfd[1],&gst,sizeof(gst))!=sizeof(gst)) _exit(-1);
+                _exit(0);
+            }
+            close(pfd[1]);
+            if (pid<0){
+                perror("fork");
+                close(pfd[0]);
+                return -1;
+            }
+            pids[i]=pid;
+            fds[i]=pfd[0];
+            games[i]=started++;
+        }
+
+        pid_t pid=wait(nullptr);
+        if (pid<0){
+            perror("wait");
+            return -1;
+        }
+        for (int i=0;i<jobs;i++){
+            if (pids[i]!=pid) continue;
+            GameStats gst;
+            bool ok=(read(fds[i],&gst,sizeof(gst))==sizeof(gst));
+            close(fds[i]);
+            pids[i]=0;
+            finished++;
+            if (!ok){
+                printf("Game %d failed\n",games[i]);
+                break;
+            }
+            int turns=gst.turns>0?gst.turns:1;
+            fprintf(out,"%d,%d,%d,%d,%llu,%llu,%.1f,%llu\n",
+                games[i],baseSeed+games[i],gst.turns,gst.score,
+                (unsigned long long)gst.nodes,
+                (unsigned long long)gst.searchMs,
+                (double)gst.searchMs/turns,
+                (unsigned long long)gst.maxTurnMs);
+            fflush(out);
+            printf("Game %4d | %5d turns | score %6d | %d/%d done\n",
+                games[i],gst.turns,gst.score,finished,optBatch);
+            fflush(stdout);
+            break;
+        }
+    }
+    fclose(out);
+
+    double hours=(timeSinceEpochMillisec()-startMs)/3600000.0;
+    printf("%d games in %.1f s, %.1f games/hour\n",
+        optBatch,hours*3600,optBatch/hours);
+    return 0;
+}
+
+// Position recorded for --bench
+struct BenchPosition{
+    GameState gs;
+    PieceQueue pq;
+};
+typedef struct BenchPosition BenchPosition;
+
+// Start of each turn of a game played with a plain search over each
+// turn's pieces. Same pieces and moves every run, so timings can be
+// compared between builds.
+std::vector<BenchPosition> recordBenchPositions(PieceGenerator *pgen, int numTurns){
+    srand(1);
+    std::vector<BenchPosition> positions;
+    std::atomic<bool> noKill(false);
+    GameState gs;
+    PieceQueue pq;
+    for (int turn=0;turn<numTurns;turn++){
+        for (int i=0;i<PIECES_PER_TURN;i++) pq.addPiece(pgen->generate());
+        pq.rebase(gs.getCurrentStepNum());
+        BenchPosition bp;
+        bp.gs=gs;
+        bp.pq=pq;
+        positions.push_back(bp);
+        for (int i=0;i<PIECES_PER_TURN;i++){
+            uint32_t step=gs.getCurrentStepNum();
+            DFSResult dr=search(gs,0,pq.turnEnd(step)-step,gs.getScore(),
+                &pq,&noKill);
+            if (!dr.valid) return positions;
+            pq.bringForward(step+dr.slot,step);
+            gs.applyPlacement(dr.bestPlacement);
+        }
+    }
+    return positions;
+}
+
+// Calls f(bi,pmt,x,y) for every pool piece at every anchor within its
+// range on every board, legal or not. A template so benches timing
+// cheap calls through it don't pay for an indirect call.
+template<typename F>
+void forEachPoolAnchor(std::vector<Board> &boards, PieceGenerator *pgen, F f){
+    for (size_t bi=0;bi<boards.size();bi++){
+        for (int i=0;i<pgen->getPoolSize();i++){
+            PlacementMaskTable *pmt=findPlacementMaskTable(pgen->getPoolPiece(i));
+            for (int x=0;x<BOARD_SIZE-pmt->bbox.x;x++){
+                for (int y=0;y<BOARD_SIZE-pmt->bbox.y;y++){
+                    f(bi,pmt,x,y);
+                }
+            }
+        }
+    }
+}
+
+// --bench: time the engine's building blocks on recorded positions.
+// Runs single-threaded, and the transposition table is never allocated,
+// so search timings measure the search itself.
+int runBench(){
+    PieceGenerator *pgen=readPieceDef("piecedefs.txt");
+    randSearchPG=pgen;
+    initPlacementTables(pgen);
+    std::vector<BenchPosition> positions=recordBenchPositions(pgen,40);
+    std::vector<Board> boards;
+    for (BenchPosition &bp:positions) boards.push_back(bp.gs.getBoard());
+    // Every 4th position for the slow searches
+    std::vector<BenchPosition> searchPositions;
+    for (size_t i=0;i<positions.size();i+=4) searchPositions.push_back(positions[i]);
+    printf("%d positions recorded, %d searched\n\n",
+        (int)positions.size(),(int)searchPositions.size());
+
+    printBenchHeader();
+    runBenchmark("Board::countCells",[&](uint64_t *){
+        uint64_t sum=0;
+        for (Board b:boards) sum+=b.countCells();
+        benchSink+=sum;
+        return (uint64_t)boards.size();
+    });
+    runBenchmark("Board::dilate",[&](uint64_t *){
+        uint64_t sum=0;
+        for (Board b:boards) sum+=(uint64_t)b.dilate().getBits();
+        benchSink+=sum;
+        return (uint64_t)boards.size();
+    });
+    runBenchmark("floodFillBoard",[&](uint64_t *){
+        uint64_t sum=0;
+        for (Board b:boards) sum+=(uint64_t)floodFillBoard(b,b.lowestCell()).getBits();
+        benchSink+=sum;
+        return (uint64_t)boards.size();
+    });
+    runBenchmark("labelIslands",[&](uint64_t *){
+        uint64_t sum=0;
+        int sizes[BOARD_CELLS/2+1];
+        for (Board b:boards) sum+=labelIslands(b.bitwiseNOT(),sizes);
+        benchSink+=sum;
+        return (uint64_t)boards.size();
+    });
+    runBenchmark("calculateIslandness",[&](uint64_t *){
+        uint64_t sum=0;
+        for (Board b:boards) sum+=calculateIslandness(b.bitwiseNOT());
+        benchSink+=sum;
+        return (uint64_t)boards.size();
+    });
+    runBenchmark("calculateBoardFitness",[&](uint64_t *){
+        uint64_t sum=0;
+        for (Board b:boards) sum+=calculateBoardFitness(b);
+        benchSink+=sum;
+        return (uint64_t)boards.size();
+    });
+    // Leaf boards: every legal placement of every pool piece on every
+    // board, scored from scratch and from the parent's islands
+    std::vector<IslandSummary> parents(boards.size());
+    std::vector<std::pair<int,Board>> children;
+    for (size_t bi=0;bi<boards.size();bi++) summarizeIslands(boards[bi],&parents[bi]);
+    forEachPoolAnchor(boards,pgen,[&](size_t bi, PlacementMaskTable *pmt, int x, int y){
+        PlacementResult pr=doPlacementMasked(boards[bi],pmt->masks[x][y],pmt->numBlocks);
+        assert(legalAnchors(boards[bi],pmt).read(x,y)==pr.success);
+        if (!pr.success) return;
+        assert(calculateBoardFitnessFrom(&parents[bi],pr.finalResult)
+            ==calculateBoardFitness(pr.finalResult));
+        children.push_back(std::make_pair((int)bi,pr.finalResult));
+    });
+    runBenchmark("calculateBoardFitness (leaf)",[&](uint64_t *){
+        uint64_t sum=0;
+        for (auto &c:children) sum+=calculateBoardFitness(c.second);
+        benchSink+=sum;
+        return (uint64_t)children.size();
+    });
+    runBenchmark("calculateBoardFitnessFrom",[&](uint64_t *){
+        uint64_t sum=0;
+        for (auto &c:children) sum+=calculateBoardFitnessFrom(&parents[c.first],c.second);
+        benchSink+=sum;
+        return (uint64_t)children.size();
+    });
+    // Every pool piece at every anchor of every board
+    runBenchmark("doPlacement",[&](uint64_t *){
+        uint64_t sum=0;
+        uint64_t ops=0;
+        forEachPoolAnchor(boards,pgen,[&](size_t bi, PlacementMaskTable *pmt, int x, int y){
+            Placement pl;
+            pl.piece=pmt->piece;
+            pl.x=x;
+            pl.y=y;
+            sum+=doPlacement(boards[bi],pl).scoreDelta;
+            ops++;
+        });
+        benchSink+=sum;
+        return ops;
+    });
+    runBenchmark("doPlacementMasked",[&](uint64_t *){
+        uint64_t sum=0;
+        uint64_t ops=0;
+        forEachPoolAnchor(boards,pgen,[&](size_t bi, PlacementMaskTable *pmt, int x, int y){
+            sum+=doPlacementMasked(boards[bi],pmt->masks[x][y],pmt->numBlocks).scoreDelta;
+            ops++;
+        });
+        benchSink+=sum;
+        return ops;
+    });
+    runBenchmark("doPlacementAt",[&](uint64_t *){
+        uint64_t sum=0;
+        uint64_t ops=0;
+        forEachPoolAnchor(boards,pgen,[&](size_t bi, PlacementMaskTable *pmt, int x, int y){
+            sum+=doPlacementAt(boards[bi],pmt,x,y).scoreDelta;
+            ops++;
+        });
+        benchSink+=sum;
+        return ops;
+    });
+    // One op is finding every legal anchor of a piece on a board
+    runBenchmark("probe anchors (doPlacementAt)",[&](uint64_t *){
+        uint64_t sum=0;
+        forEachPoolAnchor(boards,pgen,[&](size_t bi, PlacementMaskTable *pmt, int x, int y){
+            sum+=doPlacementAt(boards[bi],pmt,x,y).success;
+        });
+        benchSink+=sum;
+        return (uint64_t)(boards.size()*pgen->getPoolSize());
+    });
+    runBenchmark("legalAnchors",[&](uint64_t *){
+        uint64_t sum=0;
+        uint64_t ops=0;
+        for (Board b:boards){
+            for (int i=0;i<pgen->getPoolSize();i++){
+                PlacementMaskTable *pmt=findPlacementMaskTable(pgen->getPoolPiece(i));
+                sum+=legalAnchors(b,pmt).countCells();
+                ops++;
+            }
+        }
+        benchSink+=sum;
+        return ops;
+    });
+    runBenchmark("findPlacementMaskTable",[&](uint64_t *){
+        uint64_t sum=0;
+        for (int i=0;i<pgen->getPoolSize();i++){
+            sum+=findPlacementMaskTable(pgen->getPoolPiece(i))->numBlocks;
+        }
+        benchSink+=sum;
+        return (uint64_t)pgen->getPoolSize();
+    });
+
+    // One op is one search from a recorded position
+    std::atomic<bool> noKill(false);
+    auto searchBench=[&](int depth, bool pruning){
+        return [&,depth,pruning](uint64_t *nodes){
+            uint64_t sum=0;
+            uint64_t startNodes=threadCounters->nodes;
+            for (BenchPosition &bp:searchPositions){
+                PieceQueue pq=bp.pq;
+                SearchBounds bounds;
+                if (pruning) initSearchBounds(&bounds,&pq,bp.gs.getCurrentStepNum(),depth);
+                DFSResult dr=search(bp.gs,0,depth,bp.gs.getScore(),&pq,&noKill,
+                    nullptr,pruning?&bounds:nullptr);
+                sum+=dr.scoreDelta;
+            }
+            *nodes+=threadCounters->nodes-startNodes;
+            benchSink+=sum;
+            return (uint64_t)searchPositions.size();
+        };
+    };
+    runBenchmark("search d2",searchBench(2,false),5);
+    runBenchmark("search d3",searchBench(3,false),5);
+    runBenchmark("search d3 pruned",searchBench(3,true),5);
+    return 0;
+}
+
+int main(int argc, char **argv){
+    parse_options(argc,argv);
+    if (optBench) return runBench();
+    if (optBatch>0) return runBatch();
+    GameStats stats;
+    return playGame(&stats);
+}
@@ -89,6 +89,9 @@ bool Piece::hasBlockAt(int x, int y){
 bool Piece::equal(Piece other){
     return data==other.data;
 }
+uint32_t Piece::getRaw(){
+    return data;
+}
 
 PieceGenerator::PieceGenerator(Piece *piecePool, int piecePoolSize){
     pp=piecePool;
@@ -97,6 +100,12 @@ PieceGenerator::PieceGenerator(Piece *piecePool, int piecePoolSize){
 Piece PieceGenerator::generate(){
     return pp[rand()%pps];
 }
+int PieceGenerator::getPoolSize(){
+    return pps;
+}
+Piece PieceGenerator::getPoolPiece(int idx){
+    return pp[idx];
+}
 void PieceGenerator::debugPrint(){
     printf("\nPieceGenerator: %d pieces.\n",pps);
     for(int i=0;i<pps;i++){
@@ -144,6 +153,24 @@ bool PieceQueue::isVisible(uint32_t idx){
 int PieceQueue::getQueueLength(){
     return queue_size;
 }
+uint32_t PieceQueue::turnEnd(uint32_t idx){
+    uint32_t end=(idx/PIECES_PER_TURN+1)*PIECES_PER_TURN;
+    uint32_t visibleEnd=baseIndex+queue_size;
+    if (end>visibleEnd) end=visibleEnd;
+    return end;
+}
+void PieceQueue::bringForward(uint32_t idx, uint32_t to){
+    int diff=idx-baseIndex;
+    int toDiff=to-baseIndex;
+    assert (toDiff>=0);
+    assert (toDiff<=diff);
+    assert (diff<queue_size);
+    Piece p=pieces[diff];
+    for (int i=diff;i>toDiff;i--){
+        pieces[i]=pieces[i-1];
+    }
+    pieces[toDiff]=p;
+}
 void PieceQueue::setPiece(uint32_t idx, Piece p){
     int diff=idx-baseIndex;
     if (diff==queue_size) addPiece(p);
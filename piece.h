@@ -28,6 +28,7 @@ public:
     bool hasBlockAt(int x, int y);
 
     bool equal(Piece other);
+    uint32_t getRaw();
 };
 
 
@@ -38,12 +39,17 @@ private:
 public:
     PieceGenerator(Piece *piecePool, int piecePoolSize);
     Piece generate();
+    int getPoolSize();
+    Piece getPoolPiece(int idx);
     void debugPrint();
 };
 
 PieceGenerator* readPieceDef(const char *filename);
 
 #define PIECEQUEUE_SIZE 20
+// Pieces are dealt in groups of this many, starting at step 0, and the
+// pieces of a group can be placed in any order.
+#define PIECES_PER_TURN 3
 class PieceQueue{
 private:
     uint32_t baseIndex;
@@ -58,4 +64,9 @@ public:
     Piece getPiece(uint32_t idx);
     bool isVisible(uint32_t idx);
     int getQueueLength();
+    // One past the last visible step dealt together with idx
+    uint32_t turnEnd(uint32_t idx);
+    // Move the piece at idx to position to (to<=idx), shifting the ones
+    // in between back by one.
+    void bringForward(uint32_t idx, uint32_t to);
 };
@@ -0,0 +1,132 @@
+#include "transposition.h"
+
+#include <cassert>
+
+#define TT_BUCKET_SIZE 4
+
+uint64_t mix64(uint64_t z){
+    z=(z^(z>>30))*0xBF58476D1CE4E5B9ULL;
+    z=(z^(z>>27))*0x94D049BB133111EBULL;
+    return z^(z>>31);
+}
+
+uint64_t hashPosition(Board b, PieceQueue *pq, uint32_t step, int remaining, bool anyOrder){
+    boardbits_t bits=b.getBits();
+    uint64_t h=mix64((uint64_t)bits);
+    h=mix64(h^(uint64_t)(bits>>64)^((uint64_t)remaining<<32));
+    if (!anyOrder){
+        for (int i=0;i<remaining && pq->isVisible(step+i);i++){
+            h=mix64(h^pq->getPiece(step+i).getRaw());
+        }
+        return h;
+    }
+    uint32_t end=step+remaining;
+    uint32_t i=step;
+    while (i<end && pq->isVisible(i)){
+        // Sort the turn's pieces so every order hashes the same
+        uint32_t turnEnd=pq->turnEnd(i);
+        uint32_t raws[PIECES_PER_TURN];
+        int n=0;
+        for (uint32_t j=i;j<turnEnd;j++){
+            uint32_t r=pq->getPiece(j).getRaw();
+            int k=n++;
+            while (k>0 && raws[k-1]>r){
+                raws[k]=raws[k-1];
+                k--;
+            }
+            raws[k]=r;
+        }
+        for (int k=0;k<n;k++) h=mix64(h^raws[k]);
+        h=mix64(h^((uint64_t)n<<40));
+        i=turnEnd;
+    }
+    return h;
+}
+
+// data layout:
+//  0..31 boardFitness, 32..47 scoreGain, 48..53 remaining depth,
+//  54 valid, 55 upperBound, 56..63 generation
+static uint64_t packData(TTValue v, int remaining, uint8_t generation){
+    assert(remaining>=0 && remaining<=TT_MAX_REMAINING);
+    assert(v.scoreGain>=INT16_MIN && v.scoreGain<=INT16_MAX);
+    uint64_t d=(uint32_t)v.boardFitness;
+    d |= ((uint64_t)(uint16_t)v.scoreGain)<<32;
+    d |= ((uint64_t)(remaining&0x3F))<<48;
+    d |= ((uint64_t)(v.valid?1:0))<<54;
+    d |= ((uint64_t)(v.upperBound?1:0))<<55;
+    d |= ((uint64_t)generation)<<56;
+    return d;
+}
+static int dataRemaining(uint64_t d){
+    return (d>>48)&0x3F;
+}
+static uint8_t dataGeneration(uint64_t d){
+    return d>>56;
+}
+
+TranspositionTable::TranspositionTable(int sizeMB){
+    uint64_t numBuckets=1;
+    uint64_t bytes=(uint64_t)sizeMB*1024*1024;
+    while (numBuckets*2*TT_BUCKET_SIZE*sizeof(Entry)<=bytes) numBuckets*=2;
+    entries=new Entry[numBuckets*TT_BUCKET_SIZE];
+    for (uint64_t i=0;i<numBuckets*TT_BUCKET_SIZE;i++){
+        entries[i].keyXorData.store(0,std::memory_order_relaxed);
+        entries[i].data.store(0,std::memory_order_relaxed);
+    }
+    bucketMask=numBuckets-1;
+    generation=1;
+}
+
+bool TranspositionTable::probe(uint64_t key, int remaining, TTValue *out){
+    Entry *bucket=&entries[(key&bucketMask)*TT_BUCKET_SIZE];
+    for (int i=0;i<TT_BUCKET_SIZE;i++){
+        uint64_t d=bucket[i].data.load(std::memory_order_relaxed);
+        uint64_t k=bucket[i].keyXorData.load(std::memory_order_relaxed)^d;
+        if (k!=key || d==0) continue;
+        // remaining is hashed into the key, this is just a sanity check
+        if (dataRemaining(d)!=(remaining&0x3F)) continue;
+        out->boardFitness=(int32_t)(uint32_t)d;
+        out->scoreGain=(int16_t)(uint16_t)(d>>32);
+        out->valid=(d>>54)&1;
+        out->upperBound=(d>>55)&1;
+        if (dataGeneration(d)!=generation){
+            // Still in use, so it belongs to the part of an earlier turn's
+            // tree that was played into. Keep it from aging out.
+            uint64_t nd=(d & ~(0xFFULL<<56)) | ((uint64_t)generation<<56);
+            bucket[i].data.store(nd,std::memory_order_relaxed);
+            bucket[i].keyXorData.store(key^nd,std::memory_order_relaxed);
+        }
+        return true;
+    }
+    return false;
+}
+
+void TranspositionTable::store(uint64_t key, int remaining, TTValue v){
+    Entry *bucket=&entries[(key&bucketMask)*TT_BUCKET_SIZE];
+    int victim=0;
+    int victimWorth=1<<30;
+    for (int i=0;i<TT_BUCKET_SIZE;i++){
+        uint64_t d=bucket[i].data.load(std::memory_order_relaxed);
+        uint64_t k=bucket[i].keyXorData.load(std::memory_order_relaxed)^d;
+        if (k==key || d==0){
+            victim=i;
+            break;
+        }
+        // Deeper entries saved more work; stale ones are worth less.
+        int worth=dataRemaining(d);
+        if (dataGeneration(d)!=generation) worth-=64;
+        if (worth<victimWorth){
+            victimWorth=worth;
+            victim=i;
+        }
+    }
+    uint64_t d=packData(v,remaining,generation);
+    bucket[victim].data.store(d,std::memory_order_relaxed);
+    bucket[victim].keyXorData.store(key^d,std::memory_order_relaxed);
+}
+
+void TranspositionTable::newGeneration(){
+    generation++;
+    // 0 is never used, so an all-zero entry always means empty
+    if (generation==0) generation=1;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+
+#include "piece.h"
+#include "game.h"
+
+// Search result of a position, relative to the position itself.
+struct TTValue{
+    int32_t scoreGain;    // score gained from this position to the best leaf
+    int32_t boardFitness; // fitness of that leaf
+    bool valid;           // false if every future dies
+    // Left by a pruned search: the real result scores strictly below
+    // scoreGain/boardFitness, and valid means nothing.
+    bool upperBound;
+};
+typedef struct TTValue TTValue;
+
+// Entries hold the remaining depth in 6 bits and scoreGain in 16, so
+// searches may be at most this deep.
+#define TT_MAX_REMAINING 63
+
+// splitmix64 finalizer
+uint64_t mix64(uint64_t z);
+
+// Key for a board with `remaining` pieces still to place, starting at step.
+// The pieces themselves are hashed in, so random-sample queues that share
+// a prefix also share entries.
+// With anyOrder, each turn's pieces are hashed as a set, including those
+// past the last one placed, since the search may pick any of them.
+// Pieces not dealt yet are left out; remaining still tells them apart.
+uint64_t hashPosition(Board b, PieceQueue *pq, uint32_t step, int remaining, bool anyOrder);
+
+// Fixed-size table shared by all search threads, without locks.
+// Each entry stores key^data next to data, so a torn write from two
+// threads racing on the same slot fails the key check instead of
+// returning a mixed-up value.
+// Buckets hold 4 entries. On a miss, the victim is the shallowest entry,
+// with entries from earlier turns (generations) going first. A probe hit
+// moves the entry to the current generation, so the subtree under the
+// move actually played carries over to the next turns.
+class TranspositionTable{
+private:
+    struct Entry{
+        std::atomic<uint64_t> keyXorData;
+        std::atomic<uint64_t> data;
+    };
+    Entry *entries;
+    uint64_t bucketMask;
+    uint8_t generation;
+public:
+    TranspositionTable(int sizeMB);
+    bool probe(uint64_t key, int remaining, TTValue *out);
+    void store(uint64_t key, int remaining, TTValue v);
+    // Call once per turn, before the search starts.
+    void newGeneration();
+};